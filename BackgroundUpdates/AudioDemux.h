@@ -0,0 +1,487 @@
+﻿#pragma once
+
+#include "BufferPool.h"
+#include "Deinterleave.h"
+#include "SpscQueue.h"
+
+// One block of audio for every channel in a single pool buffer.  The header
+// holds the bookkeeping for all channels; the planes follow it in the
+// buffer's payload, each starting on an Align boundary.  How many frames a
+// block holds is only fixed at run time, by the pool's payload size and the
+// channel count: a Config::payload_size of payload_size(channels, frames)
+// gives blocks of at least frames.
+//
+// A silent block is all zeros, but its planes are never written; check silent
+// before reading them and take the shortcut.
+//
+// A block is only short (length < capacity) when a discontinuity ends it; the
+// next block has discontinuity set and says how many frames are missing in
+// between.
+template<typename T, int Align>
+struct alignas(Align)
+    AudioBlock
+{
+    // Samples from one plane to the next for planes of at least frames.
+    static constexpr size_t plane_stride(const size_t frames) noexcept
+    {
+        return (frames * sizeof(T) + Align - 1) / Align * Align / sizeof(T);
+    }
+
+    static constexpr size_t payload_size(const int channels, const size_t frames) noexcept
+    {
+        return channels * plane_stride(frames) * sizeof(T);
+    }
+
+    // Frames per plane when a payload of size bytes is split into channels
+    // planes.
+    static constexpr size_t capacity_for(const size_t size, const int channels) noexcept
+    {
+        return size / channels / Align * Align / sizeof(T);
+    }
+
+    // Blocks are numbered in the order they were started.  A block dropped on
+    // overflow still takes its number, so a gap tells the consumer how many
+    // are missing.
+    uint64_t sequence;
+    // steady_clock ticks when the block's first frame arrived.
+    std::chrono::steady_clock::rep timestamp;
+    // Frames known to be missing just before this one's first frame, whether
+    // lost upstream or dropped by the demuxer, including any blocks lost to
+    // overflow.  discontinuity is also set for a gap of unknown length.
+    uint64_t gap_frames;
+    uint32_t length;
+    // Frames each plane has room for, which is also the distance from one
+    // plane to the next.  The demuxer sets it, and channels, on allocation.
+    uint32_t capacity;
+    uint32_t channels;
+    uint32_t data_offset;
+    bool silent;
+    bool discontinuity;
+
+    T* plane(const int channel) noexcept
+    {
+        return reinterpret_cast<T*>(reinterpret_cast<uint8_t*>(this) + data_offset) + channel * capacity;
+    }
+    const T* plane(const int channel) const noexcept
+    {
+        return reinterpret_cast<const T*>(reinterpret_cast<const uint8_t*>(this) + data_offset) + channel * capacity;
+    }
+
+    void reset() noexcept { length = 0; silent = false; gap_frames = 0; discontinuity = false; }
+
+    void attach(void* payload, size_t) noexcept
+    {
+        data_offset = static_cast<uint32_t>(static_cast<uint8_t*>(payload) - reinterpret_cast<uint8_t*>(this));
+        capacity = 0;
+        channels = 0;
+    }
+};
+
+// Splits interleaved capture data into the planes of pooled AudioBlocks,
+// converting from the capture format as it goes.  Use create(), which picks an
+// implementation with the channel count fixed at compile time for the common
+// layouts.
+//
+// A routing other than the identity is applied in the same pass: channels()
+// is then the number of routed outputs, and inputs no output uses are never
+// read, written or allocated for.
+//
+// Each output can be conditioned with a Preprocessing (gain, DC blocking,
+// pre-emphasis).  It runs inside the same kernel, on samples still in
+// registers, and its state carries from one add() to the next.
+//
+// Full blocks go out on a single ring.  If it is full the block goes back to
+// the pool and is counted in overflows().  Frames are also dropped when the
+// pool has no block to give; dropped_frames() counts both, and the block
+// after them carries the gap.
+template<typename T, int Align>
+class AudioDemux
+{
+public:
+    typedef AudioBlock<T, Align> block_type;
+    typedef BufferPool<block_type, Align> pool_type;
+    typedef SpscQueue<typename pool_type::unique_ptr_type> queue_type;
+
+    // Blocks hold as many frames as routing.outputs() planes of the pool's
+    // payload have room for; see AudioBlock::payload_size().
+    static std::unique_ptr<AudioDemux> create(std::shared_ptr<pool_type> pool, SampleFormat format,
+                                              ChannelRouting routing, size_t queue_depth = 16);
+    static std::unique_ptr<AudioDemux> create(std::shared_ptr<pool_type> pool, const SampleFormat format,
+                                              const int channels, const size_t queue_depth = 16)
+    {
+        return create(std::move(pool), format, ChannelRouting::identity(channels), queue_depth);
+    }
+
+    AudioDemux() = delete;
+    AudioDemux(const AudioDemux &) = delete;
+    virtual ~AudioDemux() = default;
+
+    virtual void add(const void* data, const size_t data_size) = 0;
+    // The stream breaks before the next add(): the block being filled goes out
+    // as it is, and the next one records the gap.  From the thread that adds.
+    virtual void mark_discontinuity(uint64_t missing_frames) = 0;
+
+    int channels() const noexcept { return channels_; }
+    int input_channels() const noexcept { return routing_.inputs(); }
+    // Frames in every block but one a discontinuity cuts short.
+    size_t block_frames() const noexcept { return block_frames_; }
+    SampleFormat format() const noexcept { return format_; }
+    const ChannelRouting& routing() const noexcept { return routing_; }
+
+    // The consumer side.  Only one thread may pop.
+    queue_type& queue() const noexcept { return *queue_; }
+    uint64_t overflows() const noexcept { return overflows_.load(std::memory_order_relaxed); }
+    uint64_t dropped_frames() const noexcept { return dropped_frames_.load(std::memory_order_relaxed); }
+
+    // The handler runs on the capture thread after a block is pushed, at most
+    // once until the consumer calls acknowledge_ready(), so it can afford to
+    // take a lock to wake the consumer.  Acknowledge before draining.  Set it
+    // before capture starts.
+    void set_ready_handler(std::function<void()> handler) { ready_handler_ = std::move(handler); }
+    void acknowledge_ready() noexcept { ready_pending_.store(false, std::memory_order_release); }
+
+    // For every output, or for one.  Set it before capture starts; it resets
+    // the filter state.
+    void set_preprocessing(const Preprocessing& settings)
+    {
+        for (auto& filter : filters_)
+            filter = ChannelFilter{ settings };
+
+        update_filtering();
+    }
+    void set_preprocessing(const int channel, const Preprocessing& settings)
+    {
+        filters_.at(channel) = ChannelFilter{ settings };
+
+        update_filtering();
+    }
+
+protected:
+    AudioDemux(std::shared_ptr<pool_type> pool, const SampleFormat format, ChannelRouting routing,
+               const size_t queue_depth)
+        : format_(format), routing_(std::move(routing)), channels_(routing_.outputs()),
+          frame_size_(sample_size(format) * routing_.inputs()),
+          block_frames_(block_type::capacity_for(pool->payload_size(), channels_)), filters_(channels_),
+          pool_(std::move(pool)),
+          queue_(std::make_unique<queue_type>(queue_depth))
+    { }
+
+    const SampleFormat format_;
+    const ChannelRouting routing_;
+    const int channels_;
+    const size_t frame_size_;
+    const size_t block_frames_;
+
+    std::vector<ChannelFilter> filters_;
+    bool filtering_ = false;
+
+    // The queue goes first, so blocks still on it are released while their
+    // pool is alive.
+    const std::shared_ptr<pool_type> pool_;
+    const std::unique_ptr<queue_type> queue_;
+    std::atomic<uint64_t> overflows_{ 0 };
+    std::atomic<uint64_t> dropped_frames_{ 0 };
+    std::function<void()> ready_handler_;
+    std::atomic<bool> ready_pending_{ false };
+
+    // True if every filter has come to rest, so silence can skip them.
+    bool settle_filters() noexcept
+    {
+        auto settled = true;
+
+        for (auto& filter : filters_)
+            settled = filter.settle() && settled;
+
+        return settled;
+    }
+private:
+    void update_filtering() noexcept
+    {
+        filtering_ = std::any_of(filters_.begin(), filters_.end(),
+                                 [](const ChannelFilter& filter) { return !filter.is_identity(); });
+    }
+};
+
+// Per-channel storage: a std::array when the count is known at compile time,
+// a std::vector sized once otherwise.
+template<typename U, int Channels>
+struct ChannelArray
+{
+    typedef std::array<U, Channels> type;
+
+    static type make(int) { return type{}; }
+};
+
+template<typename U>
+struct ChannelArray<U, 0>
+{
+    typedef std::vector<U> type;
+
+    static type make(const int channels) { return type(channels); }
+};
+
+// Channels is the number of outputs; 0 takes the count at run time.
+template<typename T, int Align, int Channels>
+class AudioDemuxImpl final : public AudioDemux<T, Align>
+{
+public:
+    typedef typename AudioDemux<T, Align>::pool_type pool_type;
+
+    AudioDemuxImpl(std::shared_ptr<pool_type> pool, const SampleFormat format, ChannelRouting routing,
+                   const size_t queue_depth)
+        : AudioDemux<T, Align>(std::move(pool), format, std::move(routing), queue_depth),
+          deinterleave_(this->routing_.is_identity() ? Deinterleave<T>::find(format, this->channels_) : nullptr),
+          mix_(this->routing_.is_identity() ? nullptr : Mix::find(format, this->routing_.inputs())),
+          mix_filter_(Mix::find_filtered(format, this->routing_.inputs())),
+          planes_(ChannelArray<T*, Channels>::make(this->channels_)),
+          partial_(this->frame_size_)
+    { }
+
+    void add(const void* data, const size_t data_size) override;
+    void mark_discontinuity(uint64_t missing_frames) override;
+
+private:
+    // Exactly one of these is set.  mix_filter_ takes over from either while
+    // any output is filtered.
+    const deinterleave_fn<T> deinterleave_;
+    const mix_fn mix_;
+    const mix_filter_fn mix_filter_;
+
+    // The block being filled is kept between calls and only handed on once
+    // all block_frames() are written, as is any frame a packet split.
+    typename pool_type::unique_ptr_type block_;
+    typename ChannelArray<T*, Channels>::type planes_;
+    size_t fill_ = 0;
+    uint64_t sequence_ = 0;
+    std::vector<uint8_t> partial_;
+    size_t partial_size_ = 0;
+    bool partial_silent_ = false;
+    // For the next block to start.
+    uint64_t gap_frames_ = 0;
+    bool discontinuity_ = false;
+
+    int channel_count() const noexcept { return 0 == Channels ? this->channels() : Channels; }
+    // p == nullptr writes silence.
+    void write(const uint8_t* p, size_t frames);
+    void hand_off();
+    void drop(uint64_t frames) noexcept;
+};
+
+template<typename T, int Align>
+std::unique_ptr<AudioDemux<T, Align>> AudioDemux<T, Align>::create(std::shared_ptr<pool_type> pool,
+                                                                               const SampleFormat format,
+                                                                               ChannelRouting routing,
+                                                                               const size_t queue_depth)
+{
+    const auto block_frames = block_type::capacity_for(pool->payload_size(), routing.outputs());
+
+    if (0 == block_frames)
+        throw std::invalid_argument("The pool's blocks are too small for the channel count");
+    if (block_frames > UINT32_MAX)
+        throw std::invalid_argument("The pool's blocks are too large");
+
+    switch (routing.outputs())
+    {
+    case 1: return std::make_unique<AudioDemuxImpl<T, Align, 1>>(std::move(pool), format, std::move(routing), queue_depth);
+    case 2: return std::make_unique<AudioDemuxImpl<T, Align, 2>>(std::move(pool), format, std::move(routing), queue_depth);
+    case 4: return std::make_unique<AudioDemuxImpl<T, Align, 4>>(std::move(pool), format, std::move(routing), queue_depth);
+    case 6: return std::make_unique<AudioDemuxImpl<T, Align, 6>>(std::move(pool), format, std::move(routing), queue_depth);
+    case 8: return std::make_unique<AudioDemuxImpl<T, Align, 8>>(std::move(pool), format, std::move(routing), queue_depth);
+    default: return std::make_unique<AudioDemuxImpl<T, Align, 0>>(std::move(pool), format, std::move(routing), queue_depth);
+    }
+}
+
+template<typename T, int Align, int Channels>
+void AudioDemuxImpl<T, Align, Channels>::add(const void* data, const size_t data_size)
+{
+    // A null data pointer means data_size bytes of silence.
+
+    const auto frame_size = this->frame_size_;
+
+    auto p = static_cast<const uint8_t*>(data);
+    auto size = data_size;
+
+    // Finish the frame the last packet split.
+    if (partial_size_ > 0)
+    {
+        const auto needed = std::min(frame_size - partial_size_, size);
+
+        if (p)
+        {
+            memcpy(&partial_[partial_size_], p, needed);
+            p += needed;
+        }
+        else
+            memset(&partial_[partial_size_], 0, needed);
+
+        partial_size_ += needed;
+        partial_silent_ = partial_silent_ && !p;
+        size -= needed;
+
+        if (partial_size_ < frame_size)
+            return;
+
+        partial_size_ = 0;
+
+        write(partial_silent_ ? nullptr : partial_.data(), 1);
+    }
+
+    const auto frames = size / frame_size;
+
+    write(p, frames);
+
+    const auto remainder = size - frames * frame_size;
+
+    if (remainder > 0)
+    {
+        if (p)
+            memcpy(&partial_[0], p + frames * frame_size, remainder);
+        else
+            memset(&partial_[0], 0, remainder);
+
+        partial_size_ = remainder;
+        partial_silent_ = !p;
+    }
+}
+
+template<typename T, int Align, int Channels>
+void AudioDemuxImpl<T, Align, Channels>::write(const uint8_t* p, size_t frames)
+{
+    const auto channels = channel_count();
+
+    while (frames > 0)
+    {
+        if (!block_)
+        {
+            // The frames are dropped if the pool has nothing to give.
+            block_ = this->pool_->allocate();
+
+            if (!block_)
+            {
+                drop(frames);
+                return;
+            }
+
+            block_->capacity = static_cast<uint32_t>(this->block_frames_);
+            block_->channels = static_cast<uint32_t>(channels);
+            block_->sequence = sequence_++;
+            block_->timestamp = std::chrono::steady_clock::now().time_since_epoch().count();
+            block_->silent = true;
+            block_->gap_frames = gap_frames_;
+            block_->discontinuity = discontinuity_;
+
+            gap_frames_ = 0;
+            discontinuity_ = false;
+
+            fill_ = 0;
+        }
+
+        const auto block = block_.get();
+        const auto length = std::min(this->block_frames_ - fill_, frames);
+
+        // Silence into filters that haven't come to rest isn't silence out.
+        if (p || (this->filtering_ && !this->settle_filters()))
+        {
+            if (block->silent)
+            {
+                // Sound after silence; only now do the zeros need writing.
+                for (auto c = 0; c < channels; ++c)
+                    memset(block->plane(c), 0, sizeof(T) * fill_);
+
+                block->silent = false;
+            }
+
+            for (auto c = 0; c < channels; ++c)
+                planes_[c] = block->plane(c) + fill_;
+
+            if (!p)
+            {
+                for (auto c = 0; c < channels; ++c)
+                {
+                    memset(planes_[c], 0, sizeof(T) * length);
+
+                    this->filters_[c].apply(planes_[c], length);
+                }
+            }
+            else
+            {
+                if (this->filtering_)
+                    mix_filter_(p, this->routing_, this->filters_.data(), planes_.data(), length);
+                else if (mix_)
+                    mix_(p, this->routing_, planes_.data(), length);
+                else
+                    deinterleave_(p, channels, planes_.data(), length);
+
+                p += length * this->frame_size_;
+            }
+        }
+        else if (!block->silent)
+        {
+            for (auto c = 0; c < channels; ++c)
+                memset(block->plane(c) + fill_, 0, sizeof(T) * length);
+        }
+
+        fill_ += length;
+        frames -= length;
+
+        if (fill_ < this->block_frames_)
+            break;
+
+        block->length = static_cast<uint32_t>(fill_);
+
+        hand_off();
+    }
+}
+
+template<typename T, int Align, int Channels>
+void AudioDemuxImpl<T, Align, Channels>::mark_discontinuity(const uint64_t missing_frames)
+{
+    // Half a frame from before the gap is no use after it.
+    if (partial_size_ > 0)
+    {
+        partial_size_ = 0;
+        drop(1);
+    }
+
+    if (block_ && fill_ > 0)
+    {
+        block_->length = static_cast<uint32_t>(fill_);
+
+        hand_off();
+    }
+
+    gap_frames_ += missing_frames;
+    discontinuity_ = true;
+}
+
+template<typename T, int Align, int Channels>
+void AudioDemuxImpl<T, Align, Channels>::hand_off()
+{
+    const auto length = block_->length;
+    const auto gap_frames = block_->gap_frames;
+
+    if (!this->queue_->try_push(std::move(block_)))
+    {
+        block_.reset();
+
+        this->overflows_.fetch_add(1, std::memory_order_relaxed);
+
+        // The gap in front of the lost block moves on to the next one.
+        drop(length);
+        gap_frames_ += gap_frames;
+
+        return;
+    }
+
+    if (this->ready_handler_ && !this->ready_pending_.exchange(true, std::memory_order_acq_rel))
+        this->ready_handler_();
+}
+
+template<typename T, int Align, int Channels>
+void AudioDemuxImpl<T, Align, Channels>::drop(const uint64_t frames) noexcept
+{
+    this->dropped_frames_.fetch_add(frames, std::memory_order_relaxed);
+
+    gap_frames_ += frames;
+    discontinuity_ = true;
+}
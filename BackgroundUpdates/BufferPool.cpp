@@ -2,4 +2,217 @@
 
 #include "BufferPool.h"
 
+#if _WIN32
+#include <Psapi.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
 
+namespace
+{
+    constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+    size_t round_up(const size_t value, const size_t alignment)
+    {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    size_t page_size()
+    {
+#if _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+
+        return info.dwPageSize;
+#else
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+}
+
+#if _WIN32
+
+BufferPoolMemory::BufferPoolMemory(const size_t size, const bool huge_pages, const bool lock) : size_(size)
+{
+    if (huge_pages)
+    {
+        // Large pages need SeLockMemoryPrivilege; without it we quietly fall
+        // back to normal pages.
+        const auto large_page = GetLargePageMinimum();
+
+        if (large_page > 0)
+        {
+            const auto rounded = round_up(size, large_page);
+
+            mapping_ = VirtualAlloc(nullptr, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+
+            if (mapping_)
+            {
+                mapping_size_ = rounded;
+                huge_pages_ = true;
+
+                // Large pages are never paged out.
+                locked_ = true;
+            }
+        }
+    }
+
+    if (!mapping_)
+    {
+        mapping_size_ = round_up(size, page_size());
+
+        mapping_ = VirtualAlloc(nullptr, mapping_size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+
+        if (!mapping_)
+            throw std::bad_alloc();
+    }
+
+    data_ = static_cast<uint8_t*>(mapping_);
+
+    prefault();
+
+    if (lock && !locked_)
+    {
+        // VirtualLock is limited by the minimum working set size.
+        const auto process = GetCurrentProcess();
+        SIZE_T minimum, maximum;
+
+        if (GetProcessWorkingSetSize(process, &minimum, &maximum))
+            SetProcessWorkingSetSize(process, minimum + mapping_size_, maximum + mapping_size_);
+
+        locked_ = !!VirtualLock(mapping_, mapping_size_);
+    }
+}
+
+BufferPoolMemory::~BufferPoolMemory()
+{
+    if (!mapping_)
+        return;
+
+    if (locked_ && !huge_pages_)
+        VirtualUnlock(mapping_, mapping_size_);
+
+    VirtualFree(mapping_, 0, MEM_RELEASE);
+}
+
+#else // _WIN32
+
+BufferPoolMemory::BufferPoolMemory(const size_t size, const bool huge_pages, const bool lock) : size_(size)
+{
+    // Over-allocate so the region can start on a huge page boundary.
+    const auto alignment = huge_pages ? huge_page_size : page_size();
+
+    mapping_size_ = round_up(size, alignment) + (huge_pages ? huge_page_size : 0);
+
+    mapping_ = mmap(nullptr, mapping_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == mapping_)
+    {
+        mapping_ = nullptr;
+
+        throw std::bad_alloc();
+    }
+
+    data_ = reinterpret_cast<uint8_t*>(round_up(reinterpret_cast<uintptr_t>(mapping_), alignment));
+
+#ifdef MADV_HUGEPAGE
+    // Must come before the pages are touched.
+    if (huge_pages)
+        huge_pages_ = 0 == madvise(data_, round_up(size, huge_page_size), MADV_HUGEPAGE);
+#endif
+
+    prefault();
+
+    if (lock)
+        locked_ = 0 == mlock(data_, size_);
+}
+
+BufferPoolMemory::~BufferPoolMemory()
+{
+    if (!mapping_)
+        return;
+
+    if (locked_)
+        munlock(data_, size_);
+
+    munmap(mapping_, mapping_size_);
+}
+
+#endif // _WIN32
+
+void BufferPoolMemory::prefault() const noexcept
+{
+    const auto step = page_size();
+    const auto p = static_cast<volatile uint8_t*>(data_);
+
+    for (size_t offset = 0; offset < size_; offset += step)
+        p[offset] = 0;
+}
+
+#if _WIN32
+
+bool memory_resident(const void* p, const size_t size) noexcept
+{
+    if (0 == size)
+        return true;
+
+    const auto step = page_size();
+    const auto first = reinterpret_cast<uintptr_t>(p) / step * step;
+    const auto last = reinterpret_cast<uintptr_t>(p) + size;
+
+    PSAPI_WORKING_SET_EX_INFORMATION info[256];
+
+    for (auto address = first; address < last;)
+    {
+        DWORD count = 0;
+
+        for (; count < _countof(info) && address < last; ++count, address += step)
+            info[count].VirtualAddress = reinterpret_cast<void*>(address);
+
+        if (!QueryWorkingSetEx(GetCurrentProcess(), info, count * sizeof(info[0])))
+            return false;
+
+        for (DWORD i = 0; i < count; ++i)
+        {
+            if (!info[i].VirtualAttributes.Valid)
+                return false;
+        }
+    }
+
+    return true;
+}
+
+#else // _WIN32
+
+bool memory_resident(const void* p, const size_t size) noexcept
+{
+    if (0 == size)
+        return true;
+
+    const auto step = page_size();
+    const auto first = reinterpret_cast<uintptr_t>(p) / step * step;
+    const auto last = reinterpret_cast<uintptr_t>(p) + size;
+
+    unsigned char vector[256];
+
+    for (auto address = first; address < last;)
+    {
+        const auto length = std::min(last - address, sizeof(vector) * step);
+
+        if (0 != mincore(reinterpret_cast<void*>(address), length, vector))
+            return false;
+
+        for (size_t i = 0; i < (length + step - 1) / step; ++i)
+        {
+            if (!(vector[i] & 1))
+                return false;
+        }
+
+        address += length;
+    }
+
+    return true;
+}
+
+#endif // _WIN32
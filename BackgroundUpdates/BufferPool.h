@@ -1,45 +1,412 @@
 ﻿#pragma once
 
+// True if every page of [p, p + size) is in physical memory right now.
+bool memory_resident(const void* p, size_t size) noexcept;
+
+// One contiguous region backing every buffer of a slab-mode BufferPool.  The
+// region is prefaulted on construction, so the capture path never takes the
+// first-touch page faults.  Huge pages and locking are best effort; check
+// huge_pages() and locked() to see what was actually granted.
+class BufferPoolMemory final
+{
+public:
+    BufferPoolMemory(size_t size, bool huge_pages, bool lock);
+    BufferPoolMemory(const BufferPoolMemory&) = delete;
+    BufferPoolMemory& operator=(const BufferPoolMemory&) = delete;
+    ~BufferPoolMemory();
+
+    uint8_t* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    bool huge_pages() const noexcept { return huge_pages_; }
+    bool locked() const noexcept { return locked_; }
+    bool resident() const noexcept { return memory_resident(data_, size_); }
+private:
+    void* mapping_ = nullptr;
+    size_t mapping_size_ = 0;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    bool huge_pages_ = false;
+    bool locked_ = false;
+
+    void prefault() const noexcept;
+};
+
 template<class T, int Align>
 class BufferPool final
 {
-    // Should we pull in boost instead...?
+    // Free buffers are kept on a Treiber stack of slot indices.  The head packs
+    // the index of the top slot into the low 32 bits and a tag into the high
+    // 32 bits.  The tag is bumped on every update so a pop that raced with a
+    // pop/push of the same slot fails its CAS instead of corrupting the list (ABA).
+    // The links live in next_, not in the buffers, so reading a stale link is
+    // harmless, even if the buffer has since been freed by trim().
+    //
+    // Each stack entry is really a chain of chain_length_[head] slots linked
+    // through chain_.  Without magazines every chain has length one.  With
+    // magazines a thread moves a whole chain to or from the stack (the depot)
+    // with a single CAS.
+
+    struct Slot
+    {
+        T value;
+        uint32_t index;
+        std::atomic<uint32_t> references;
+        std::chrono::steady_clock::rep allocated_at;
+    };
+
+    static_assert(std::is_standard_layout<Slot>::value, "T must be standard layout");
+
+    static constexpr uint32_t empty_index = ~uint32_t{ 0 };
+    static constexpr int cache_count = 16;
+public:
+    static constexpr int hold_time_buckets = 24;
+private:
 
-    std::mutex lock_;
-    std::stack<std::unique_ptr<T>> free_;
+    // Per-thread magazine.  Threads are hashed onto cache_count of these; a
+    // thread that finds its cache busy (a hash collision) uses the depot directly.
+    struct alignas(64) ThreadCache
+    {
+        std::atomic<bool> busy{ false };
+        uint32_t count = 0;
+        uint32_t* items = nullptr;
+
+        std::atomic<uint64_t> allocations{ 0 };
+        std::atomic<uint64_t> releases{ 0 };
+        std::atomic<uint64_t> depot_transfers{ 0 };
+    };
 public:
+    // The deleter is a single pointer, so unique_ptr_type is two pointers wide
+    // and neither allocate() nor release() touches the heap.
     class Releaser final
     {
     public:
-        void operator()(T* p) const
+        Releaser() = default;
+
+        void operator()(T* p) const noexcept
         {
-            pool_.release(p);
+            pool_->release(p);
         }
     private:
-        explicit Releaser(BufferPool& pool) : pool_(pool)
+        explicit Releaser(BufferPool* pool) noexcept : pool_(pool)
         { }
-        BufferPool & pool_;
+        BufferPool* pool_ = nullptr;
         friend class BufferPool;
     };
 
-    typedef std::unique_ptr<T, std::function<void(T*)>> unique_ptr_type;
+    typedef std::unique_ptr<T, Releaser> unique_ptr_type;
+
+    static_assert(sizeof(unique_ptr_type) == 2 * sizeof(void*), "Pool handles should be two pointers");
+
+    // Read-only, reference counted handle for fanning one buffer out to
+    // several consumers.  Copies only touch the count stored next to the
+    // buffer; the last one out hands the buffer to the Releaser.
+    class SharedHandle final
+    {
+    public:
+        SharedHandle() = default;
+        SharedHandle(const SharedHandle& other) noexcept : p_(other.p_), releaser_(other.releaser_)
+        {
+            if (p_)
+                slot_from(p_)->references.fetch_add(1, std::memory_order_relaxed);
+        }
+        SharedHandle(SharedHandle&& other) noexcept : p_(other.p_), releaser_(other.releaser_)
+        {
+            other.p_ = nullptr;
+        }
+        SharedHandle& operator=(SharedHandle other) noexcept
+        {
+            std::swap(p_, other.p_);
+            std::swap(releaser_, other.releaser_);
+
+            return *this;
+        }
+        ~SharedHandle()
+        {
+            reset();
+        }
+
+        void reset() noexcept
+        {
+            if (!p_)
+                return;
+
+            if (1 == slot_from(p_)->references.fetch_sub(1, std::memory_order_acq_rel))
+                releaser_(const_cast<T*>(p_));
+
+            p_ = nullptr;
+        }
+
+        const T* get() const noexcept { return p_; }
+        const T& operator*() const noexcept { return *p_; }
+        const T* operator->() const noexcept { return p_; }
+        explicit operator bool() const noexcept { return nullptr != p_; }
+
+        uint32_t use_count() const noexcept
+        {
+            return p_ ? slot_from(p_)->references.load(std::memory_order_relaxed) : 0;
+        }
+    private:
+        SharedHandle(const T* p, const Releaser releaser) noexcept : p_(p), releaser_(releaser)
+        { }
+
+        const T* p_ = nullptr;
+        Releaser releaser_;
+
+        friend class BufferPool;
+    };
+
+    typedef SharedHandle shared_ptr_type;
+
+    static_assert(sizeof(shared_ptr_type) == 2 * sizeof(void*), "Shared pool handles should be two pointers");
+
+    // Give up write access to a filled buffer so it can be handed to any
+    // number of readers.
+    static shared_ptr_type share(unique_ptr_type buffer) noexcept
+    {
+        if (!buffer)
+            return {};
+
+        const auto releaser = buffer.get_deleter();
+        const auto p = buffer.release();
+
+        slot_from(p)->references.store(1, std::memory_order_relaxed);
+
+        return shared_ptr_type{ p, releaser };
+    }
+
+    // An elastic pool (max_count > buffer_count) asks for a refill when the
+    // free list drops below low_watermark and for a trim when it rises above
+    // high_watermark and the pool hasn't grown for idle_delay.  Both are
+    // serviced by maintain(), which should run on a background thread; the
+    // real-time path never allocates or frees memory.  Capacity grows in
+    // grow_chunk steps up to max_count and shrinks back toward buffer_count.
+    //
+    // A slab pool carves all max_count buffers out of one BufferPoolMemory
+    // region instead of allocating each one separately.  lock_memory implies
+    // slab, since only the whole region can be locked.
+    //
+    // prefault zeroes every byte of each buffer (header and payload) as it is
+    // added to the pool, so the first pass on the capture thread doesn't take
+    // page faults.  Use resident() to check that the pages stayed put.
+    //
+    // payload_size reserves that many bytes after each buffer's header.  If
+    // T has an attach(void*, size_t) member, it is given the payload once,
+    // when the buffer is constructed.
+    struct Config
+    {
+        int buffer_count = 0;
+        int magazine_size = 0;
+        int max_count = 0;
+        int grow_chunk = 0;
+        int low_watermark = 0;
+        int high_watermark = 0;
+        std::chrono::milliseconds idle_delay{ 1000 };
+        bool slab = false;
+        bool huge_pages = false;
+        bool lock_memory = false;
+        bool prefault = false;
+        size_t payload_size = 0;
+    };
+
+    // A snapshot of the pool's counters, safe to take from any thread.  The
+    // counters are read one at a time, so under load they may be off by the
+    // few operations that raced with the snapshot.
+    //
+    // allocations, releases, failures and depot_transfers are cumulative; take
+    // two snapshots to get rates.  Without magazines every allocation and
+    // release is one operation on the shared free list (batches excepted);
+    // with magazines only depot_transfers are.
+    //
+    // hold_time_us[i] counts buffers that were held for [2^i, 2^(i+1))
+    // microseconds (bucket 0 includes anything under a microsecond, the last
+    // bucket anything longer).
+    struct Stats
+    {
+        uint64_t allocations;
+        uint64_t releases;
+        uint64_t failures;
+        uint64_t depot_transfers;
+        int in_use;
+        int high_water;
+        int capacity;
+        std::array<uint64_t, hold_time_buckets> hold_time_us;
+    };
 
-    BufferPool(const int buffer_count);
+    // A magazine_size of zero disables the per-thread caches.
+    BufferPool(const int buffer_count, const int magazine_size = 0);
+    explicit BufferPool(const Config& config);
     BufferPool() = delete;
+    BufferPool(const BufferPool&) = delete;
     ~BufferPool();
 
-    unique_ptr_type allocate();
+    // Never blocks and never asks for more memory.
+    unique_ptr_type try_allocate();
+    // Never blocks, but asks for a refill when the pool is running low.
+    unique_ptr_type allocate_or_grow();
+    unique_ptr_type allocate() { return allocate_or_grow(); }
+    // Waits up to timeout for a buffer to be released or for the pool to grow.
+    // Not for use on the real-time thread.
+    template<class Rep, class Period>
+    unique_ptr_type allocate_for(const std::chrono::duration<Rep, Period>& timeout);
+
     void release(unique_ptr_type buffer) { buffer.reset(); }
+
+    // Fill buffers[0..count) with one pass over this thread's cache (and the
+    // depot, a magazine at a time).  All or nothing: on failure nothing is
+    // taken.  The buffers should be empty on entry.
+    bool allocate_n(unique_ptr_type* buffers, size_t count);
+    // Return every non-null buffer in buffers[0..count) at once.
+    void release_n(unique_ptr_type* buffers, size_t count) noexcept;
+
+    // The handler is called, at most once per pending request, from whichever
+    // thread noticed the pool needs attention (possibly the real-time thread).
+    // It should only signal a background thread to call maintain().  Set it
+    // before the pool is shared.
+    void set_refill_handler(std::function<void()> handler) { refill_handler_ = std::move(handler); }
+    void maintain();
+
+    int capacity() const noexcept { return capacity_.load(std::memory_order_relaxed); }
+    size_t payload_size() const noexcept { return payload_size_; }
+    // Null unless this is a slab pool.
+    const BufferPoolMemory* slab() const noexcept { return slab_.get(); }
+    // True if every buffer the pool currently owns is in physical memory.
+    // Not for use on the real-time thread.
+    bool resident();
+    Stats stats() const noexcept;
 private:
-    Releaser releaser_;
-    void release(T* p);
+    const int min_count_;
+    const int max_count_;
+    const int grow_chunk_;
+    const int low_watermark_;
+    const int high_watermark_;
+    const std::chrono::steady_clock::duration idle_delay_;
+    const size_t payload_size_;
+    const size_t slot_stride_;
+    const bool prefault_;
+
+    std::unique_ptr<BufferPoolMemory> slab_;
+    std::unique_ptr<Slot*[]> slots_;
+    std::unique_ptr<std::atomic<uint32_t>[]> next_;
+    std::unique_ptr<uint32_t[]> chain_;
+    std::unique_ptr<uint32_t[]> chain_length_;
+    alignas(64) std::atomic<uint64_t> head_{ empty_index };
+    std::atomic<int> depot_count_{ 0 };
+
+    const uint32_t magazine_size_;
+    std::unique_ptr<uint32_t[]> cache_items_;
+    std::unique_ptr<ThreadCache[]> caches_;
+
+    alignas(64) std::atomic<uint64_t> uncached_allocations_{ 0 };
+    std::atomic<uint64_t> uncached_releases_{ 0 };
+
+    // Elastic state.  grow_lock_ is only taken by maintain().
+    alignas(64) std::atomic<int> capacity_{ 0 };
+    std::atomic<bool> refill_requested_{ false };
+    std::atomic<std::chrono::steady_clock::rep> trim_after_{ 0 };
+    std::function<void()> refill_handler_;
+    std::mutex grow_lock_;
+    std::vector<uint32_t> vacant_;
+
+    std::atomic<int> waiters_{ 0 };
+    std::mutex wait_lock_;
+    std::condition_variable wait_cv_;
+
+    alignas(64) std::atomic<int> in_use_{ 0 };
+    std::atomic<int> high_water_{ 0 };
+    std::atomic<uint64_t> failures_{ 0 };
+    std::array<std::atomic<uint64_t>, hold_time_buckets> hold_times_{};
+
+    void note_allocated(size_t count) noexcept;
+    void note_released(Slot* slot) noexcept;
+
+    void release(T* p) noexcept;
+
+    uint32_t take() noexcept;
+    unique_ptr_type wrap(uint32_t index) noexcept;
+
+    bool is_elastic() const noexcept { return max_count_ > min_count_; }
+    void check_low() noexcept;
+    void check_idle() noexcept;
+    void request_refill() noexcept;
+    void wake_waiters() noexcept;
+
+    void grow(int count);
+    void trim(int count);
+
+    ThreadCache* acquire_cache() noexcept;
+    static void release_cache(ThreadCache* cache) noexcept
+    {
+        cache->busy.store(false, std::memory_order_release);
+    }
+
+    bool refill_cache(ThreadCache& cache) noexcept;
+    void stash(ThreadCache* cache, uint32_t head, uint32_t length) noexcept;
+    void flush_cache(ThreadCache& cache) noexcept;
+    uint32_t steal() noexcept;
+
+    uint32_t pop_one() noexcept;
+
+    void push(uint32_t head, uint32_t length) noexcept;
+    uint32_t pop() noexcept;
+
+    static unsigned thread_cache_index() noexcept
+    {
+        static std::atomic<unsigned> next_index{ 0 };
+        static thread_local const unsigned index = next_index.fetch_add(1, std::memory_order_relaxed);
+
+        return index;
+    }
+
+    static void increment(std::atomic<uint64_t>& counter, const uint64_t count = 1) noexcept
+    {
+        // Only the owner of the cache writes, so no RMW is needed.
+        counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
 
-    static void* allocate_raw()
+    static Slot* slot_from(T* p) noexcept
+    {
+        return reinterpret_cast<Slot*>(p);
+    }
+    static Slot* slot_from(const T* p) noexcept
+    {
+        return slot_from(const_cast<T*>(p));
+    }
+
+    static constexpr size_t round_up(const size_t size) noexcept
+    {
+        return (size + Align - 1) / Align * Align;
+    }
+
+    static constexpr size_t payload_offset = round_up(sizeof(Slot));
+
+    template<class U>
+    static auto attach_payload(U& value, void* payload, size_t size, int) -> decltype(value.attach(payload, size), void())
+    {
+        value.attach(payload, size);
+    }
+    template<class U>
+    static void attach_payload(U&, void*, size_t, long)
+    { }
+
+    void* allocate_slot(const uint32_t index) const
+    {
+        if (slab_)
+            return slab_->data() + index * slot_stride_;
+
+        return allocate_raw(slot_stride_);
+    }
+    void free_slot(void* p) const noexcept
+    {
+        if (!slab_)
+            free_raw(p);
+    }
+
+    static void* allocate_raw(const size_t size)
     {
 #if _WIN32
-        return _aligned_malloc(sizeof(T), Align);
+        return _aligned_malloc(size, Align);
 #else
-        return std::aligned_alloc(Align, sizeof(T));
+        return std::aligned_alloc(Align, size);
 #endif
     }
     static void free_raw(void* p) noexcept
@@ -47,70 +414,827 @@ private:
 #if _WIN32
         _aligned_free(p);
 #else
-        std::aligned_free(p);
+        std::free(p);
 #endif
     }
 
     friend class Releaser;
 };
 
-template<class T, int Align = 32>
-BufferPool<T, Align>::BufferPool(const int buffer_count) : releaser_(*this)
+template<class T, int Align>
+BufferPool<T, Align>::BufferPool(const int buffer_count, const int magazine_size)
+    : BufferPool(Config{ buffer_count, magazine_size })
+{ }
+
+template<class T, int Align>
+BufferPool<T, Align>::BufferPool(const Config& config)
+    : min_count_{ std::max(config.buffer_count, 0) },
+      max_count_{ std::max(config.max_count, min_count_) },
+      grow_chunk_{ std::max(config.grow_chunk, 1) },
+      low_watermark_{ config.low_watermark },
+      high_watermark_{ std::max(config.high_watermark, config.low_watermark + grow_chunk_) },
+      idle_delay_{ config.idle_delay },
+      payload_size_{ config.payload_size },
+      slot_stride_{ round_up(payload_offset + config.payload_size) },
+      prefault_{ config.prefault },
+      slots_{ std::make_unique<Slot*[]>(max_count_) },
+      next_{ std::make_unique<std::atomic<uint32_t>[]>(max_count_) },
+      chain_{ std::make_unique<uint32_t[]>(max_count_) },
+      chain_length_{ std::make_unique<uint32_t[]>(max_count_) },
+      magazine_size_{ static_cast<uint32_t>(std::max(config.magazine_size, 0)) }
 {
-    for (auto i = 0; i < buffer_count; ++i)
+    if ((config.slab || config.lock_memory) && max_count_ > 0)
+        slab_ = std::make_unique<BufferPoolMemory>(max_count_ * slot_stride_, config.huge_pages, config.lock_memory);
+
+    if (magazine_size_ > 0)
     {
-        free_.push(std::unique_ptr<T>{new (allocate_raw()) T});
+        // Each cache holds up to two magazines so a thread that alternates
+        // between allocating and releasing doesn't bounce off the depot.
+        cache_items_ = std::make_unique<uint32_t[]>(cache_count * 2 * magazine_size_);
+        caches_ = std::make_unique<ThreadCache[]>(cache_count);
+
+        for (auto i = 0; i < cache_count; ++i)
+            caches_[i].items = &cache_items_[i * 2 * magazine_size_];
+    }
+
+    // Hand out the low indices first.
+    vacant_.reserve(max_count_);
+
+    for (auto i = max_count_; i > 0; --i)
+        vacant_.push_back(static_cast<uint32_t>(i - 1));
+
+    try
+    {
+        grow(min_count_);
+    }
+    catch (...)
+    {
+        trim(capacity());
+
+        throw;
     }
 }
 
-template<class T, int Align = 32>
+template<class T, int Align>
 BufferPool<T, Align>::~BufferPool()
 {
-    decltype(free_) temp;
+    for (auto i = 0; i < max_count_; ++i)
+    {
+        const auto slot = slots_[i];
+
+        if (!slot)
+            continue;
+
+        slot->~Slot();
+
+        free_slot(slot);
+    }
+}
+
+template<class T, int Align>
+typename BufferPool<T, Align>::unique_ptr_type BufferPool<T, Align>::try_allocate()
+{
+    const auto index = take();
+
+    note_allocated(empty_index != index ? 1 : 0);
+
+    return wrap(index);
+}
+
+template<class T, int Align>
+typename BufferPool<T, Align>::unique_ptr_type BufferPool<T, Align>::allocate_or_grow()
+{
+    const auto index = take();
+
+    if (is_elastic())
+    {
+        if (empty_index == index)
+            request_refill();
+        else
+            check_low();
+    }
+
+    note_allocated(empty_index != index ? 1 : 0);
+
+    return wrap(index);
+}
+
+template<class T, int Align>
+template<class Rep, class Period>
+typename BufferPool<T, Align>::unique_ptr_type BufferPool<T, Align>::allocate_for(
+    const std::chrono::duration<Rep, Period>& timeout)
+{
+    auto index = take();
+
+    if (empty_index != index)
+    {
+        if (is_elastic())
+            check_low();
+
+        note_allocated(1);
+
+        return wrap(index);
+    }
+
+    if (is_elastic())
+        request_refill();
+
+    const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+    std::unique_lock<std::mutex> lock{ wait_lock_ };
+
+    waiters_.fetch_add(1);
+
+    for (;;)
+    {
+        // Pairs with the fence in wake_waiters(): either we see the released
+        // buffer or the releaser sees us waiting.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        index = take();
+
+        if (empty_index != index || std::cv_status::timeout == wait_cv_.wait_until(lock, deadline))
+            break;
+    }
+
+    waiters_.fetch_sub(1);
+
+    if (empty_index == index)
+        index = take();
+
+    note_allocated(empty_index != index ? 1 : 0);
+
+    return wrap(index);
+}
+
+template<class T, int Align>
+bool BufferPool<T, Align>::allocate_n(unique_ptr_type* buffers, const size_t count)
+{
+    if (0 == count)
+        return true;
+
+    size_t taken = 0;
+
+    const auto cache = acquire_cache();
+
+    if (cache)
+    {
+        while (taken < count && cache->count > 0)
+            buffers[taken++] = wrap(cache->items[--cache->count]);
+    }
+
+    while (taken < count)
+    {
+        auto index = pop();
+
+        if (empty_index == index)
+            break;
+
+        auto length = chain_length_[index];
+
+        for (; length > 0 && taken < count; --length)
+        {
+            buffers[taken++] = wrap(index);
+
+            index = chain_[index];
+        }
+
+        stash(cache, index, length);
+
+        if (cache)
+            increment(cache->depot_transfers);
+    }
+
+    while (taken < count)
+    {
+        const auto index = steal();
+
+        if (empty_index == index)
+            break;
+
+        buffers[taken++] = wrap(index);
+    }
+
+    const auto success = taken == count;
+
+    if (!success)
+    {
+        // Put everything back as a single chain.
+        auto head = empty_index;
+
+        for (size_t i = 0; i < taken; ++i)
+        {
+            assert(buffers[i].get_deleter().pool_ == this);
+
+            const auto index = slot_from(buffers[i].release())->index;
+
+            chain_[index] = head;
+            head = index;
+        }
+
+        stash(cache, head, static_cast<uint32_t>(taken));
+    }
+
+    if (cache)
+    {
+        if (success)
+            increment(cache->allocations, count);
+
+        release_cache(cache);
+    }
+    else if (success)
+        uncached_allocations_.fetch_add(count, std::memory_order_relaxed);
+
+    note_allocated(success ? count : 0);
+
+    if (is_elastic())
+    {
+        if (success)
+            check_low();
+        else
+            request_refill();
+    }
+
+    return success;
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::release_n(unique_ptr_type* buffers, const size_t count) noexcept
+{
+    auto head = empty_index;
+    uint32_t length = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!buffers[i])
+            continue;
+
+        // Only release() is reached through the handle's own Releaser.
+        assert(buffers[i].get_deleter().pool_ == this);
+
+        const auto slot = slot_from(buffers[i].release());
+
+        note_released(slot);
+
+        chain_[slot->index] = head;
+        head = slot->index;
+        ++length;
+    }
+
+    if (0 == length)
+        return;
+
+    const auto released = length;
+
+    if (const auto cache = acquire_cache())
+    {
+        for (; length > 0; --length)
+        {
+            // stash() may have left the cache full, so make room first.
+            if (cache->count == 2 * magazine_size_)
+                flush_cache(*cache);
+
+            cache->items[cache->count++] = head;
+
+            head = chain_[head];
+        }
+
+        increment(cache->releases, released);
+
+        release_cache(cache);
+    }
+    else
+    {
+        uncached_releases_.fetch_add(released, std::memory_order_relaxed);
+
+        push(head, length);
+    }
+
+    if (is_elastic())
+        check_idle();
+
+    wake_waiters();
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::maintain()
+{
+    refill_requested_.store(false, std::memory_order_relaxed);
+
+    if (!is_elastic())
+        return;
+
     {
-        std::lock_guard<std::mutex> lock{ lock_ };
+        // Scope
+        std::lock_guard<std::mutex> lock{ grow_lock_ };
+
+        const auto available = depot_count_.load(std::memory_order_relaxed);
+
+        if (available < low_watermark_ || available <= 0)
+        {
+            const auto count = std::min(grow_chunk_, max_count_ - capacity());
 
-        temp.swap(free_);
+            if (count > 0)
+            {
+                grow(count);
+
+                trim_after_.store((std::chrono::steady_clock::now() + idle_delay_).time_since_epoch().count(),
+                    std::memory_order_relaxed);
+            }
+        }
+        else if (available > high_watermark_
+            && std::chrono::steady_clock::now().time_since_epoch().count() >= trim_after_.load(std::memory_order_relaxed))
+        {
+            // The pool is idle; give back what we don't need, keeping enough
+            // that the next burst won't immediately ask for more.
+            const auto count = std::min(available - (low_watermark_ + grow_chunk_), capacity() - min_count_);
+
+            if (count > 0)
+                trim(count);
+        }
     }
 
-    while (!temp.empty())
+    wake_waiters();
+}
+
+template<class T, int Align>
+typename BufferPool<T, Align>::Stats BufferPool<T, Align>::stats() const noexcept
+{
+    Stats stats{};
+
+    stats.failures = failures_.load(std::memory_order_relaxed);
+    stats.in_use = in_use_.load(std::memory_order_relaxed);
+    stats.high_water = high_water_.load(std::memory_order_relaxed);
+    stats.capacity = capacity();
+
+    for (auto i = 0; i < hold_time_buckets; ++i)
+        stats.hold_time_us[i] = hold_times_[i].load(std::memory_order_relaxed);
+
+    stats.allocations = uncached_allocations_.load(std::memory_order_relaxed);
+    stats.releases = uncached_releases_.load(std::memory_order_relaxed);
+    stats.depot_transfers = stats.allocations + stats.releases;
+
+    if (!caches_)
+        return stats;
+
+    for (auto i = 0; i < cache_count; ++i)
     {
-        auto p = std::move(temp.top());
+        const auto& cache = caches_[i];
 
-        temp.pop();
+        stats.allocations += cache.allocations.load(std::memory_order_relaxed);
+        stats.releases += cache.releases.load(std::memory_order_relaxed);
+        stats.depot_transfers += cache.depot_transfers.load(std::memory_order_relaxed);
+    }
 
-        p->~T();
+    return stats;
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::release(T* p) noexcept
+{
+    const auto slot = slot_from(p);
+    const auto index = slot->index;
+
+    note_released(slot);
+
+    if (const auto cache = acquire_cache())
+    {
+        // stash() may have left the cache full, so make room first.
+        if (cache->count == 2 * magazine_size_)
+            flush_cache(*cache);
 
-        free_raw(p.release());
+        cache->items[cache->count++] = index;
+
+        increment(cache->releases);
+
+        release_cache(cache);
+    }
+    else
+    {
+        push(index, 1);
+
+        uncached_releases_.fetch_add(1, std::memory_order_relaxed);
     }
+
+    if (is_elastic())
+        check_idle();
+
+    wake_waiters();
 }
 
-template<class T, int Align = 32>
-typename BufferPool<T, Align>::unique_ptr_type BufferPool<T, Align>::allocate()
+template<class T, int Align>
+uint32_t BufferPool<T, Align>::take() noexcept
 {
-    std::unique_ptr<T> p;
+    auto index = empty_index;
 
-    {//Scope
-        std::lock_guard<std::mutex> lock{ lock_ };
+    if (const auto cache = acquire_cache())
+    {
+        if (cache->count > 0 || refill_cache(*cache))
+        {
+            index = cache->items[--cache->count];
+
+            increment(cache->allocations);
+        }
 
-        if (free_.empty())
-            return { nullptr, [](T*) { } };
+        release_cache(cache);
+    }
+
+    if (empty_index == index)
+    {
+        index = pop_one();
 
-        p = std::move(free_.top());
+        if (empty_index == index)
+            index = steal();
 
-        free_.pop();
+        if (empty_index == index)
+            return empty_index;
+
+        uncached_allocations_.fetch_add(1, std::memory_order_relaxed);
     }
 
+    return index;
+}
+
+template<class T, int Align>
+typename BufferPool<T, Align>::unique_ptr_type BufferPool<T, Align>::wrap(const uint32_t index) noexcept
+{
+    if (empty_index == index)
+        return {};
+
+    const auto slot = slots_[index];
+
+    slot->allocated_at = std::chrono::steady_clock::now().time_since_epoch().count();
+
+    auto p = &slot->value;
+
     p->reset();
 
-    return { p.release(), [this](T* p) { release(p); } };
+    return unique_ptr_type{ p, Releaser{ this } };
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::note_allocated(const size_t count) noexcept
+{
+    if (0 == count)
+    {
+        failures_.fetch_add(1, std::memory_order_relaxed);
+
+        return;
+    }
+
+    const auto in_use = in_use_.fetch_add(static_cast<int>(count), std::memory_order_relaxed) + static_cast<int>(count);
+
+    auto high_water = high_water_.load(std::memory_order_relaxed);
+
+    while (in_use > high_water && !high_water_.compare_exchange_weak(high_water, in_use, std::memory_order_relaxed))
+    { }
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::note_released(Slot* slot) noexcept
+{
+    in_use_.fetch_sub(1, std::memory_order_relaxed);
+
+    const auto held = std::chrono::steady_clock::duration{
+        std::chrono::steady_clock::now().time_since_epoch().count() - slot->allocated_at };
+
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(held).count();
+
+    auto bucket = 0;
+
+    while (us > 1 && bucket < hold_time_buckets - 1)
+    {
+        us >>= 1;
+        ++bucket;
+    }
+
+    hold_times_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::check_low() noexcept
+{
+    if (depot_count_.load(std::memory_order_relaxed) < low_watermark_ && capacity() < max_count_)
+        request_refill();
 }
 
-template<class T, int Align = 32>
-void BufferPool<T, Align>::release(T* p)
+template<class T, int Align>
+void BufferPool<T, Align>::check_idle() noexcept
 {
-    std::lock_guard<std::mutex> lock{ lock_ };
+    if (depot_count_.load(std::memory_order_relaxed) <= high_watermark_ || capacity() <= min_count_)
+        return;
 
-    free_.push(std::unique_ptr<T>(p));
+    if (std::chrono::steady_clock::now().time_since_epoch().count() < trim_after_.load(std::memory_order_relaxed))
+        return;
+
+    request_refill();
 }
 
+template<class T, int Align>
+void BufferPool<T, Align>::request_refill() noexcept
+{
+    if (refill_requested_.load(std::memory_order_relaxed) || refill_requested_.exchange(true))
+        return;
+
+    if (!refill_handler_)
+        return;
+
+    try
+    {
+        refill_handler_();
+    }
+    catch (...)
+    {
+        // Let the next request try again.
+        refill_requested_.store(false);
+    }
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::wake_waiters() noexcept
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    if (waiters_.load(std::memory_order_relaxed) <= 0)
+        return;
+
+    {
+        // Scope
+        std::lock_guard<std::mutex> lock{ wait_lock_ };
+    }
+
+    wait_cv_.notify_all();
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::grow(const int count)
+{
+    // Called from the constructor or with grow_lock_ held.
+
+    const auto chain_size = std::max(magazine_size_, uint32_t{ 1 });
+    auto chain_head = empty_index;
+    uint32_t chain_count = 0;
+
+    for (auto i = 0; i < count && !vacant_.empty(); ++i)
+    {
+        const auto index = vacant_.back();
+
+        auto raw = allocate_slot(index);
+
+        if (!raw)
+        {
+            if (chain_count > 0)
+                push(chain_head, chain_count);
+
+            throw std::bad_alloc();
+        }
+
+        if (prefault_)
+            memset(raw, 0, slot_stride_);
+
+        auto slot = new (raw) Slot{};
+
+        slot->index = index;
+
+        if (payload_size_ > 0)
+            attach_payload(slot->value, static_cast<uint8_t*>(raw) + payload_offset, payload_size_, 0);
+        vacant_.pop_back();
+
+        slots_[slot->index] = slot;
+        capacity_.fetch_add(1, std::memory_order_relaxed);
+
+        chain_[slot->index] = chain_head;
+        chain_head = slot->index;
+
+        if (++chain_count == chain_size)
+        {
+            push(chain_head, chain_count);
+
+            chain_head = empty_index;
+            chain_count = 0;
+        }
+    }
+
+    if (chain_count > 0)
+        push(chain_head, chain_count);
+}
+
+template<class T, int Align>
+bool BufferPool<T, Align>::resident()
+{
+    if (slab_)
+        return slab_->resident();
+
+    std::lock_guard<std::mutex> lock{ grow_lock_ };
+
+    for (auto i = 0; i < max_count_; ++i)
+    {
+        if (slots_[i] && !memory_resident(slots_[i], slot_stride_))
+            return false;
+    }
+
+    return true;
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::trim(int count)
+{
+    // Called from the constructor or with grow_lock_ held.  Only buffers on
+    // the free list are released; anything in a thread cache or in use stays.
+
+    while (count > 0)
+    {
+        auto index = pop();
+
+        if (empty_index == index)
+            return;
+
+        auto length = chain_length_[index];
+
+        while (length > 0 && count > 0)
+        {
+            const auto next = chain_[index];
+            const auto slot = slots_[index];
+
+            slots_[index] = nullptr;
+
+            slot->~Slot();
+            free_slot(slot);
+
+            vacant_.push_back(index);
+            capacity_.fetch_sub(1, std::memory_order_relaxed);
+
+            index = next;
+            --length;
+            --count;
+        }
+
+        if (length > 0)
+            push(index, length);
+    }
+}
+
+template<class T, int Align>
+typename BufferPool<T, Align>::ThreadCache* BufferPool<T, Align>::acquire_cache() noexcept
+{
+    if (!caches_)
+        return nullptr;
+
+    auto& cache = caches_[thread_cache_index() % cache_count];
+
+    if (cache.busy.exchange(true, std::memory_order_acquire))
+        return nullptr;
+
+    return &cache;
+}
+
+template<class T, int Align>
+bool BufferPool<T, Align>::refill_cache(ThreadCache& cache) noexcept
+{
+    const auto index = pop();
+
+    if (empty_index == index)
+        return false;
+
+    stash(&cache, index, chain_length_[index]);
+
+    increment(cache.depot_transfers);
+
+    return true;
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::stash(ThreadCache* cache, uint32_t head, uint32_t length) noexcept
+{
+    // Keep what fits in the cache and send the rest of the chain back to the
+    // depot in one push.
+
+    if (cache)
+    {
+        for (; length > 0 && cache->count < 2 * magazine_size_; --length)
+        {
+            cache->items[cache->count++] = head;
+
+            head = chain_[head];
+        }
+    }
+
+    if (length > 0)
+        push(head, length);
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::flush_cache(ThreadCache& cache) noexcept
+{
+    // Hand the older magazine to the depot and keep the most recently
+    // released (and so most likely cache-warm) buffers.
+
+    auto head = empty_index;
+
+    for (uint32_t i = 0; i < magazine_size_; ++i)
+    {
+        const auto index = cache.items[i];
+
+        chain_[index] = head;
+        head = index;
+    }
+
+    std::copy(cache.items + magazine_size_, cache.items + cache.count, cache.items);
+
+    cache.count -= magazine_size_;
+
+    push(head, magazine_size_);
+
+    increment(cache.depot_transfers);
+}
+
+template<class T, int Align>
+uint32_t BufferPool<T, Align>::steal() noexcept
+{
+    // The depot is empty, but other threads may be sitting on partial
+    // magazines.  This is only reached when the pool is (nearly) exhausted.
+
+    if (!caches_)
+        return empty_index;
+
+    for (auto i = 0; i < cache_count; ++i)
+    {
+        auto& cache = caches_[i];
+
+        if (cache.busy.exchange(true, std::memory_order_acquire))
+            continue;
+
+        auto index = empty_index;
+
+        if (cache.count > 0)
+            index = cache.items[--cache.count];
+
+        release_cache(&cache);
+
+        if (empty_index != index)
+            return index;
+    }
+
+    return empty_index;
+}
+
+template<class T, int Align>
+uint32_t BufferPool<T, Align>::pop_one() noexcept
+{
+    const auto index = pop();
+
+    if (empty_index == index)
+        return empty_index;
+
+    const auto length = chain_length_[index];
+
+    if (length > 1)
+        push(chain_[index], length - 1);
+
+    return index;
+}
+
+template<class T, int Align>
+void BufferPool<T, Align>::push(const uint32_t head, const uint32_t length) noexcept
+{
+    chain_length_[head] = length;
+
+    auto top = head_.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        next_[head].store(static_cast<uint32_t>(top), std::memory_order_relaxed);
+
+        const auto new_top = (((top >> 32) + 1) << 32) | head;
+
+        if (head_.compare_exchange_weak(top, new_top, std::memory_order_release, std::memory_order_relaxed))
+            break;
+    }
+
+    depot_count_.fetch_add(static_cast<int>(length), std::memory_order_relaxed);
+}
+
+template<class T, int Align>
+uint32_t BufferPool<T, Align>::pop() noexcept
+{
+    auto top = head_.load(std::memory_order_acquire);
+
+    for (;;)
+    {
+        const auto index = static_cast<uint32_t>(top);
+
+        if (empty_index == index)
+            return empty_index;
+
+        const auto next = next_[index].load(std::memory_order_relaxed);
+
+        const auto new_top = (((top >> 32) + 1) << 32) | next;
+
+        if (head_.compare_exchange_weak(top, new_top, std::memory_order_acquire, std::memory_order_acquire))
+        {
+            depot_count_.fetch_sub(static_cast<int>(chain_length_[index]), std::memory_order_relaxed);
+
+            return index;
+        }
+    }
+}
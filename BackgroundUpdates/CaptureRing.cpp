@@ -0,0 +1,225 @@
+﻿#include "stdafx.h"
+
+#include "CaptureRing.h"
+
+constexpr std::chrono::milliseconds CaptureRing::wait_timeout;
+
+CaptureRing::CaptureRing(const size_t capacity, const size_t frame_size, CaptureSource::read_callback_type downstream,
+                         CaptureSource::discontinuity_callback_type discontinuity_downstream)
+    : mask_{ round_up(capacity) - 1 },
+      frame_size_{ std::max<size_t>(frame_size, 1) },
+      buffer_{ std::make_unique<uint8_t[]>(mask_ + 1) },
+      downstream_{ std::move(downstream) },
+      discontinuity_downstream_{ std::move(discontinuity_downstream) }
+{
+    thread_ = std::thread{ &CaptureRing::drain, this };
+}
+
+CaptureRing::~CaptureRing()
+{
+    {
+        std::lock_guard<std::mutex> lock{ wait_lock_ };
+
+        stop_.store(true, std::memory_order_relaxed);
+    }
+
+    wait_cv_.notify_all();
+
+    if (thread_.joinable())
+        thread_.join();
+
+    // The source is stopped, so a gap that never made it into the ring can
+    // go straight on.
+    if (gap_pending_ && discontinuity_downstream_)
+        discontinuity_downstream_(gap_frames_);
+}
+
+CaptureSource::read_callback_type CaptureRing::writer()
+{
+    return [this](const uint8_t* data, const size_t size) { write(data, size); };
+}
+
+CaptureSource::discontinuity_callback_type CaptureRing::discontinuity_writer()
+{
+    return [this](const uint64_t missing_frames) { write_discontinuity(missing_frames); };
+}
+
+void CaptureRing::write(const uint8_t* data, const size_t size) noexcept
+{
+    const auto start = std::chrono::steady_clock::now();
+
+    flush_gap();
+
+    // A packet can't overtake the gap in front of it.
+    if (gap_pending_ || !push(data ? Kind::data : Kind::silence, data, size))
+    {
+        increment(dropped_packets_);
+        increment(dropped_bytes_, static_cast<uint64_t>(size));
+
+        gap_pending_ = true;
+        gap_frames_ += size / frame_size_;
+    }
+    else
+        increment(packets_);
+
+    const auto elapsed = (std::chrono::steady_clock::now() - start).count();
+
+    if (elapsed > worst_write_.load(std::memory_order_relaxed))
+        worst_write_.store(elapsed, std::memory_order_relaxed);
+}
+
+void CaptureRing::write_discontinuity(const uint64_t missing_frames) noexcept
+{
+    gap_pending_ = true;
+    gap_frames_ += missing_frames;
+
+    flush_gap();
+}
+
+void CaptureRing::flush_gap() noexcept
+{
+    if (!gap_pending_)
+        return;
+
+    if (push(Kind::discontinuity, reinterpret_cast<const uint8_t*>(&gap_frames_), sizeof(gap_frames_)))
+    {
+        gap_pending_ = false;
+        gap_frames_ = 0;
+    }
+}
+
+bool CaptureRing::push(const Kind kind, const uint8_t* data, const size_t size) noexcept
+{
+    const auto capacity = mask_ + 1;
+    const auto needed = record_size(size, kind);
+    const auto tail = tail_.load(std::memory_order_relaxed);
+
+    // Records start on a header boundary and the capacity is a multiple of
+    // the header size, so there is always room for a header before the end.
+    // A record that would wrap is padded out to the start of the ring.
+    const auto to_end = capacity - (tail & mask_);
+    const auto padding = needed > to_end ? to_end : 0;
+
+    if (tail - cached_head_ + padding + needed > capacity)
+        cached_head_ = head_.load(std::memory_order_acquire);
+
+    if (tail - cached_head_ + padding + needed > capacity || size > UINT32_MAX)
+        return false;
+
+    if (padding)
+    {
+        const Header skip{ static_cast<uint32_t>(padding - sizeof(Header)), Kind::padding };
+
+        memcpy(&buffer_[tail & mask_], &skip, sizeof(skip));
+    }
+
+    const auto offset = (tail + padding) & mask_;
+    const Header header{ static_cast<uint32_t>(size), kind };
+
+    memcpy(&buffer_[offset], &header, sizeof(header));
+
+    if (Kind::silence != kind)
+        memcpy(&buffer_[offset + sizeof(Header)], data, size);
+
+    const auto new_tail = tail + padding + needed;
+
+    // seq_cst pairs with the drain thread's store to waiting_, so one of
+    // the two sides sees the other.
+    tail_.store(new_tail, std::memory_order_seq_cst);
+
+    // cached_head_ can be far behind, so measure against where the drain
+    // thread really is.
+    cached_head_ = head_.load(std::memory_order_acquire);
+
+    const auto fill = new_tail - cached_head_;
+
+    if (fill > high_water_.load(std::memory_order_relaxed))
+        high_water_.store(fill, std::memory_order_relaxed);
+
+    if (waiting_.load(std::memory_order_seq_cst))
+        wait_cv_.notify_one();
+
+    return true;
+}
+
+void CaptureRing::drain()
+{
+    auto head = head_.load(std::memory_order_relaxed);
+
+    for (;;)
+    {
+        const auto tail = tail_.load(std::memory_order_acquire);
+
+        if (head == tail)
+        {
+            if (stop_.load(std::memory_order_relaxed))
+                break;
+
+            waiting_.store(true, std::memory_order_seq_cst);
+
+            {
+                std::unique_lock<std::mutex> lock{ wait_lock_ };
+
+                wait_cv_.wait_for(lock, wait_timeout, [this, head]()
+                {
+                    return stop_.load(std::memory_order_relaxed) || tail_.load(std::memory_order_acquire) != head;
+                });
+            }
+
+            waiting_.store(false, std::memory_order_relaxed);
+
+            continue;
+        }
+
+        while (head != tail)
+        {
+            Header header;
+
+            memcpy(&header, &buffer_[head & mask_], sizeof(header));
+
+            // Records never wrap.
+            const auto body = (head & mask_) + sizeof(Header);
+
+            if (Kind::padding == header.kind)
+            { }
+            else if (Kind::silence == header.kind)
+                downstream_(nullptr, header.size);
+            else if (Kind::discontinuity == header.kind)
+            {
+                uint64_t missing_frames;
+
+                memcpy(&missing_frames, &buffer_[body], sizeof(missing_frames));
+
+                if (discontinuity_downstream_)
+                    discontinuity_downstream_(missing_frames);
+            }
+            else if (header.size > 0)
+                downstream_(&buffer_[body], header.size);
+
+            head += record_size(header.size, header.kind);
+
+            // Hand the space back a record at a time, so a long drain doesn't
+            // starve the writer.
+            head_.store(head, std::memory_order_release);
+        }
+    }
+}
+
+CaptureRing::Stats CaptureRing::stats() const noexcept
+{
+    Stats stats;
+
+    const auto head = head_.load(std::memory_order_acquire);
+    const auto tail = tail_.load(std::memory_order_acquire);
+
+    stats.capacity = mask_ + 1;
+    stats.fill = tail - head;
+    stats.high_water = high_water_.load(std::memory_order_relaxed);
+    stats.packets = packets_.load(std::memory_order_relaxed);
+    stats.dropped_packets = dropped_packets_.load(std::memory_order_relaxed);
+    stats.dropped_bytes = dropped_bytes_.load(std::memory_order_relaxed);
+    stats.worst_write = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::duration{ worst_write_.load(std::memory_order_relaxed) });
+
+    return stats;
+}
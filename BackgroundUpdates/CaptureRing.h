@@ -0,0 +1,131 @@
+﻿#pragma once
+
+#include "CaptureSource.h"
+
+// Decouples a CaptureSource's thread from everything downstream of it.  The
+// callback from writer() only copies each packet into a lock-free ring and
+// returns, so the device buffer goes back right away whatever the demuxer is
+// doing; a drain thread passes the packets, in order, to the downstream
+// callback.
+//
+// Packets are stored whole, each behind an eight byte header, so silence (a
+// null packet) costs no copy and the downstream callback sees the same
+// packet boundaries the source produced, one call per packet.  A record that
+// won't fit before the end of the ring goes at the start instead, behind a
+// padding record that takes up the rest, so a packet over half the ring may
+// not fit anywhere.  When the ring is full the packet is dropped and
+// counted.
+//
+// The source's discontinuities travel through the ring too, in order with
+// the packets.  A dropped packet becomes one as well, passed on ahead of
+// whatever next makes it into the ring.
+//
+// The writer never locks.  It wakes a sleeping drain thread with an unlocked
+// notify, which can be missed; the drain thread wakes by itself at least
+// every wait_timeout anyway.
+class CaptureRing final
+{
+public:
+    static constexpr std::chrono::milliseconds wait_timeout{ 5 };
+
+    // capacity is in bytes, rounded up to a power of two.  frame_size is the
+    // source's, for counting the frames in dropped packets.
+    CaptureRing(size_t capacity, size_t frame_size, CaptureSource::read_callback_type downstream,
+                CaptureSource::discontinuity_callback_type discontinuity_downstream);
+    CaptureRing(const CaptureRing&) = delete;
+    CaptureRing& operator=(const CaptureRing&) = delete;
+    // Stop the source first.  Whatever is still queued is drained, and a gap
+    // left at the end is passed on from here.
+    ~CaptureRing();
+
+    // For CaptureSource::Start() and SetDiscontinuityCallback().  Only the
+    // source's thread may call them.
+    CaptureSource::read_callback_type writer();
+    CaptureSource::discontinuity_callback_type discontinuity_writer();
+
+    // worst_write is the longest any one writer() call took, which is the
+    // time the device buffer was held for on top of GetBuffer() itself.
+    struct Stats
+    {
+        size_t capacity;
+        size_t fill;
+        size_t high_water;
+        uint64_t packets;
+        uint64_t dropped_packets;
+        uint64_t dropped_bytes;
+        std::chrono::nanoseconds worst_write;
+    };
+
+    Stats stats() const noexcept;
+private:
+    enum class Kind : uint32_t
+    {
+        data,
+        silence,
+        // The body is the uint64_t count of missing frames.
+        discontinuity,
+        // Skipped; fills the end of the ring ahead of a record that starts
+        // over at the beginning.
+        padding
+    };
+
+    struct Header
+    {
+        uint32_t size;
+        Kind kind;
+    };
+
+    const size_t mask_;
+    const size_t frame_size_;
+    const std::unique_ptr<uint8_t[]> buffer_;
+    const CaptureSource::read_callback_type downstream_;
+    const CaptureSource::discontinuity_callback_type discontinuity_downstream_;
+
+    // Producer
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+    size_t cached_head_ = 0;
+    // A gap that hasn't made it into the ring yet.
+    bool gap_pending_ = false;
+    uint64_t gap_frames_ = 0;
+    std::atomic<size_t> high_water_{ 0 };
+    std::atomic<uint64_t> packets_{ 0 };
+    std::atomic<uint64_t> dropped_packets_{ 0 };
+    std::atomic<uint64_t> dropped_bytes_{ 0 };
+    std::atomic<std::chrono::steady_clock::rep> worst_write_{ 0 };
+
+    // Consumer
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    std::atomic<bool> waiting_{ false };
+    std::atomic<bool> stop_{ false };
+    std::mutex wait_lock_;
+    std::condition_variable wait_cv_;
+    std::thread thread_;
+
+    void write(const uint8_t* data, size_t size) noexcept;
+    void write_discontinuity(uint64_t missing_frames) noexcept;
+    bool push(Kind kind, const uint8_t* data, size_t size) noexcept;
+    void flush_gap() noexcept;
+    void drain();
+
+    static size_t record_size(const size_t size, const Kind kind) noexcept
+    {
+        return sizeof(Header) + (Kind::silence == kind ? 0 : (size + sizeof(Header) - 1) / sizeof(Header) * sizeof(Header));
+    }
+
+    static size_t round_up(size_t capacity) noexcept
+    {
+        size_t size = 4096;
+
+        while (size < capacity)
+            size *= 2;
+
+        return size;
+    }
+
+    template<typename T>
+    static void increment(std::atomic<T>& counter, const T count = 1) noexcept
+    {
+        // Only the producer writes, so no RMW is needed.
+        counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+};
@@ -0,0 +1,90 @@
+﻿#include "stdafx.h"
+
+#include "CaptureSource.h"
+
+namespace
+{
+    // Only the source's thread writes, so no RMW is needed.
+    template<typename T>
+    void add(std::atomic<T>& counter, const T count) noexcept
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+    }
+}
+
+CaptureSource::Stats CaptureSource::GetStats() const noexcept
+{
+    using std::chrono::duration_cast;
+    using std::chrono::nanoseconds;
+    using std::chrono::steady_clock;
+
+    Stats stats;
+
+    stats.packets = packets_.load(std::memory_order_relaxed);
+    stats.frames = frames_.load(std::memory_order_relaxed);
+    stats.discontinuities = discontinuities_.load(std::memory_order_relaxed);
+    stats.missing_frames = missing_frames_.load(std::memory_order_relaxed);
+    stats.overruns = overruns_.load(std::memory_order_relaxed);
+    stats.overrun_time = duration_cast<nanoseconds>(steady_clock::duration{ overrun_time_.load(std::memory_order_relaxed) });
+    stats.worst_callback = duration_cast<nanoseconds>(steady_clock::duration{ worst_callback_.load(std::memory_order_relaxed) });
+
+    return stats;
+}
+
+void CaptureSource::CountPacket(const size_t frames, const std::chrono::steady_clock::duration held) noexcept
+{
+    add(packets_, uint64_t{ 1 });
+    add(frames_, static_cast<uint64_t>(frames));
+
+    if (held.count() > worst_callback_.load(std::memory_order_relaxed))
+        worst_callback_.store(held.count(), std::memory_order_relaxed);
+
+    const auto rate = SamplesPerSecond();
+
+    if (0 == rate)
+        return;
+
+    const auto lasts = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+        std::chrono::duration<double>(static_cast<double>(frames) / rate));
+
+    if (held > lasts)
+    {
+        add(overruns_, uint64_t{ 1 });
+        add(overrun_time_, (held - lasts).count());
+    }
+}
+
+void CaptureSource::ReportDiscontinuity(const uint64_t missing_frames)
+{
+    add(discontinuities_, uint64_t{ 1 });
+    add(missing_frames_, missing_frames);
+
+    if (discontinuity_callback_)
+        discontinuity_callback_(missing_frames);
+}
+
+bool wave_sample_format(const uint16_t format_tag, const uint16_t bits_per_sample, SampleFormat& format) noexcept
+{
+    // WAVE_FORMAT_PCM and WAVE_FORMAT_IEEE_FLOAT, spelled out so this builds
+    // without mmreg.h.
+    const auto isPcm = 1 == format_tag;
+    const auto isFloat = 3 == format_tag;
+
+    switch (bits_per_sample)
+    {
+    case 16:
+        format = SampleFormat::int16;
+        return isPcm;
+    case 24:
+        format = SampleFormat::int24;
+        return isPcm;
+    case 32:
+        format = isFloat ? SampleFormat::float32 : SampleFormat::int32;
+        return isFloat || isPcm;
+    case 64:
+        format = SampleFormat::float64;
+        return isFloat;
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,81 @@
+﻿#pragma once
+
+#include "Deinterleave.h"
+
+// Anything that delivers interleaved capture data to a callback on its own
+// thread, the way CWASAPICapture does.  The callback gets (data, size) with
+// size a whole number of frames; data == nullptr means size bytes of
+// silence.  Everything downstream of the callback (AudioDemux and on) only
+// sees this interface, so a file or synthetic source can stand in for a
+// device.
+//
+// A source also reports where the stream isn't continuous: the device said
+// so, its position jumped, or the stream was switched.  The discontinuity
+// callback runs on the same thread, just before the packet that follows the
+// gap, with the number of frames missing (0 if that isn't known).  Stats()
+// counts the same things, along with callbacks that held the packet longer
+// than the audio in it lasts.
+//
+// Owners hold the concrete type; the destructor is not public, since
+// CWASAPICapture's lifetime is reference counted.
+class CaptureSource
+{
+public:
+    typedef std::function<void(const uint8_t *, size_t)> read_callback_type;
+    typedef std::function<void(uint64_t missing_frames)> discontinuity_callback_type;
+
+    struct Stats
+    {
+        uint64_t packets;
+        uint64_t frames;
+        uint64_t discontinuities;
+        uint64_t missing_frames;
+        // Packets whose callback ran longer than the audio they held, and the
+        // total time by which they did.
+        uint64_t overruns;
+        std::chrono::nanoseconds overrun_time;
+        std::chrono::nanoseconds worst_callback;
+    };
+
+    CaptureSource(const CaptureSource&) = delete;
+    CaptureSource& operator=(const CaptureSource&) = delete;
+
+    // The callback runs on the source's thread until Stop() returns.
+    virtual bool Start(read_callback_type read_callback) = 0;
+    virtual void Stop() = 0;
+
+    virtual int ChannelCount() const noexcept = 0;
+    virtual uint32_t SamplesPerSecond() const noexcept = 0;
+    virtual SampleFormat Format() const noexcept = 0;
+    // Frames in a typical packet; downstream buffers are sized from it.
+    virtual uint32_t PeriodFrames() const noexcept = 0;
+
+    size_t FrameSize() const noexcept { return sample_size(Format()) * ChannelCount(); }
+
+    // Set it before Start().
+    void SetDiscontinuityCallback(discontinuity_callback_type callback) { discontinuity_callback_ = std::move(callback); }
+    Stats GetStats() const noexcept;
+protected:
+    CaptureSource() = default;
+    virtual ~CaptureSource() = default;
+
+    // For the source's thread.  held is how long the read callback had the
+    // packet.
+    void CountPacket(size_t frames, std::chrono::steady_clock::duration held) noexcept;
+    void ReportDiscontinuity(uint64_t missing_frames);
+private:
+    discontinuity_callback_type discontinuity_callback_;
+
+    std::atomic<uint64_t> packets_{ 0 };
+    std::atomic<uint64_t> frames_{ 0 };
+    std::atomic<uint64_t> discontinuities_{ 0 };
+    std::atomic<uint64_t> missing_frames_{ 0 };
+    std::atomic<uint64_t> overruns_{ 0 };
+    std::atomic<std::chrono::steady_clock::rep> overrun_time_{ 0 };
+    std::atomic<std::chrono::steady_clock::rep> worst_callback_{ 0 };
+};
+
+// Maps a WAVE format tag (after resolving WAVE_FORMAT_EXTENSIBLE to its
+// subformat) and container size to a SampleFormat.  24 valid bits in a 32-bit
+// container read fine as int32.
+bool wave_sample_format(uint16_t format_tag, uint16_t bits_per_sample, SampleFormat& format) noexcept;
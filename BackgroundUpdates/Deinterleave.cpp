@@ -0,0 +1,1169 @@
+﻿#include "stdafx.h"
+
+#include "Deinterleave.h"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define DEINTERLEAVE_X86 1
+#include <immintrin.h>
+#else
+#define DEINTERLEAVE_X86 0
+#endif
+
+#if defined(_MSC_VER) && _MSC_VER >= 1800
+#define RESTRICT __restrict
+#elif defined(__GNUC__)
+#define RESTRICT __restrict__
+#else
+#define RESTRICT
+#endif
+
+// MSVC lets any function use any instruction set; gcc and clang want to be
+// told, function by function.
+#if defined(_MSC_VER)
+#define TARGET_SSE2
+#define TARGET_AVX2
+#define TARGET_AVX512
+#else
+#define TARGET_SSE2 __attribute__((target("sse2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f")))
+#endif
+
+namespace
+{
+    SimdLevel detect_simd_level() noexcept
+    {
+#if !DEINTERLEAVE_X86
+        return SimdLevel::none;
+#elif defined(_MSC_VER)
+        int info[4];
+
+        __cpuid(info, 0);
+
+        const auto max_leaf = info[0];
+
+        __cpuid(info, 1);
+
+        const auto sse2 = 0 != (info[3] & (1 << 26));
+        const auto osxsave = 0 != (info[2] & (1 << 27));
+        const auto avx = 0 != (info[2] & (1 << 28));
+
+        if (!sse2)
+            return SimdLevel::none;
+
+        if (!osxsave || !avx || max_leaf < 7)
+            return SimdLevel::sse2;
+
+        // The OS has to save the wider registers on a context switch.
+        const auto xcr0 = _xgetbv(0);
+
+        __cpuidex(info, 7, 0);
+
+        const auto avx2 = 0 != (info[1] & (1 << 5));
+        const auto avx512f = 0 != (info[1] & (1 << 16));
+
+        if (avx512f && 0xe6 == (xcr0 & 0xe6))
+            return SimdLevel::avx512;
+
+        if (avx2 && 0x06 == (xcr0 & 0x06))
+            return SimdLevel::avx2;
+
+        return SimdLevel::sse2;
+#else
+        __builtin_cpu_init();
+
+        if (__builtin_cpu_supports("avx512f"))
+            return SimdLevel::avx512;
+
+        if (__builtin_cpu_supports("avx2"))
+            return SimdLevel::avx2;
+
+        if (__builtin_cpu_supports("sse2"))
+            return SimdLevel::sse2;
+
+        return SimdLevel::none;
+#endif
+    }
+
+    template<typename T>
+    void deinterleave_mono(const void* src, int, T* const* planes, const size_t frames)
+    {
+        memcpy(planes[0], src, frames * sizeof(T));
+    }
+
+    // Finishes (or, without SIMD, does) the work for frames [start, frames).
+    template<typename T, int Channels>
+    void deinterleave_tail(const T* RESTRICT src, T* const* planes, const size_t start, const size_t frames)
+    {
+        T* RESTRICT out[Channels];
+
+        for (auto c = 0; c < Channels; ++c)
+            out[c] = planes[c];
+
+        for (auto i = start; i < frames; ++i)
+        {
+            for (auto c = 0; c < Channels; ++c)
+                out[c][i] = src[i * Channels + c];
+        }
+    }
+
+    template<typename T, int Channels>
+    void deinterleave_fixed(const void* src, int, T* const* planes, const size_t frames)
+    {
+        deinterleave_tail<T, Channels>(static_cast<const T*>(src), planes, 0, frames);
+    }
+
+    template<typename T>
+    deinterleave_fn<T> find_scalar(const int channels) noexcept
+    {
+        switch (channels)
+        {
+        case 1: return &deinterleave_mono<T>;
+        case 2: return &deinterleave_fixed<T, 2>;
+        case 4: return &deinterleave_fixed<T, 4>;
+        case 6: return &deinterleave_fixed<T, 6>;
+        case 8: return &deinterleave_fixed<T, 8>;
+        default: return &deinterleave_generic<T>;
+        }
+    }
+
+    //
+    // Sample loaders.  scalar() turns one little-endian sample into a float
+    // in [-1, 1).  load8() does eight consecutive samples at once and may read
+    // up to overread bytes past the last one.
+    //
+
+    struct LoadFloat32
+    {
+        static constexpr size_t size = 4;
+        static constexpr size_t overread = 0;
+
+        static float scalar(const uint8_t* p) noexcept
+        {
+            float value;
+            memcpy(&value, p, sizeof(value));
+            return value;
+        }
+#if DEINTERLEAVE_X86
+        TARGET_AVX2 static __m256 load8(const uint8_t* p) noexcept
+        {
+            return _mm256_loadu_ps(reinterpret_cast<const float*>(p));
+        }
+#endif
+    };
+
+    struct LoadFloat64
+    {
+        static constexpr size_t size = 8;
+        static constexpr size_t overread = 0;
+
+        static float scalar(const uint8_t* p) noexcept
+        {
+            double value;
+            memcpy(&value, p, sizeof(value));
+            return static_cast<float>(value);
+        }
+#if DEINTERLEAVE_X86
+        TARGET_AVX2 static __m256 load8(const uint8_t* p) noexcept
+        {
+            const auto lo = _mm256_cvtpd_ps(_mm256_loadu_pd(reinterpret_cast<const double*>(p)));
+            const auto hi = _mm256_cvtpd_ps(_mm256_loadu_pd(reinterpret_cast<const double*>(p) + 4));
+
+            return _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1);
+        }
+#endif
+    };
+
+    struct LoadInt16
+    {
+        static constexpr size_t size = 2;
+        static constexpr size_t overread = 0;
+
+        static float scalar(const uint8_t* p) noexcept
+        {
+            int16_t value;
+            memcpy(&value, p, sizeof(value));
+            return value * (1.0f / 32768);
+        }
+#if DEINTERLEAVE_X86
+        TARGET_AVX2 static __m256 load8(const uint8_t* p) noexcept
+        {
+            const auto value = _mm256_cvtepi16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+
+            return _mm256_mul_ps(_mm256_cvtepi32_ps(value), _mm256_set1_ps(1.0f / 32768));
+        }
+#endif
+    };
+
+    // Packed three byte samples.  Both are shifted into the top of an int32,
+    // so they share int32's scale.
+    struct LoadInt24
+    {
+        static constexpr size_t size = 3;
+        static constexpr size_t overread = 4;
+
+        static float scalar(const uint8_t* p) noexcept
+        {
+            const auto value = static_cast<int32_t>(uint32_t{ p[0] } << 8 | uint32_t{ p[1] } << 16 | uint32_t{ p[2] } << 24);
+
+            return value * (1.0f / 2147483648.0f);
+        }
+#if DEINTERLEAVE_X86
+        TARGET_AVX2 static __m256 load8(const uint8_t* p) noexcept
+        {
+            // Samples 0-3 in the low lane, 4-7 in the high lane, each moved
+            // to the top three bytes of a dword.
+            const auto lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            const auto hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 12));
+
+            const auto shuffle = _mm256_setr_epi8(
+                -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11,
+                -1, 0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11);
+
+            const auto value = _mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1), shuffle);
+
+            return _mm256_mul_ps(_mm256_cvtepi32_ps(value), _mm256_set1_ps(1.0f / 2147483648.0f));
+        }
+#endif
+    };
+
+    struct LoadInt32
+    {
+        static constexpr size_t size = 4;
+        static constexpr size_t overread = 0;
+
+        static float scalar(const uint8_t* p) noexcept
+        {
+            int32_t value;
+            memcpy(&value, p, sizeof(value));
+            return value * (1.0f / 2147483648.0f);
+        }
+#if DEINTERLEAVE_X86
+        TARGET_AVX2 static __m256 load8(const uint8_t* p) noexcept
+        {
+            const auto value = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+
+            return _mm256_mul_ps(_mm256_cvtepi32_ps(value), _mm256_set1_ps(1.0f / 2147483648.0f));
+        }
+#endif
+    };
+
+    // Channels == 0 takes the count at run time.
+    template<class Load, int Channels>
+    void convert_tail(const uint8_t* RESTRICT src, const int channels, float* const* planes,
+                      const size_t start, const size_t frames)
+    {
+        const auto count = 0 == Channels ? channels : Channels;
+
+        for (auto i = start; i < frames; ++i)
+        {
+            for (auto c = 0; c < count; ++c)
+                planes[c][i] = Load::scalar(src + (i * count + c) * Load::size);
+        }
+    }
+
+    // Only the inputs some output uses are read.
+    template<class Load, int Channels>
+    void mix_tail(const uint8_t* RESTRICT src, const int channels, const ChannelRouting& routing, float* const* planes,
+                  const size_t start, const size_t frames)
+    {
+        const auto count = 0 == Channels ? channels : Channels;
+        const auto taps = routing.taps();
+        const auto first_tap = routing.first_tap();
+        const auto outputs = routing.outputs();
+
+        for (auto i = start; i < frames; ++i)
+        {
+            const auto frame = src + i * count * Load::size;
+
+            for (auto o = 0; o < outputs; ++o)
+            {
+                auto sum = 0.0f;
+
+                for (auto t = first_tap[o]; t < first_tap[o + 1]; ++t)
+                    sum += taps[t].gain * Load::scalar(frame + taps[t].input * Load::size);
+
+                planes[o][i] = sum;
+            }
+        }
+    }
+
+    // A DC blocker fed a constant decays toward zero through the denormals,
+    // which cost a hundred times the normal rate on x86.  The filters run
+    // with them flushed to zero and put the caller's mode back afterwards.
+    class FlushDenormals final
+    {
+    public:
+#if DEINTERLEAVE_X86
+        FlushDenormals() noexcept : csr_{ _mm_getcsr() }
+        {
+            // FTZ and DAZ
+            _mm_setcsr(csr_ | 0x8040);
+        }
+        ~FlushDenormals()
+        {
+            _mm_setcsr(csr_);
+        }
+    private:
+        const unsigned int csr_;
+#endif
+    };
+
+    inline float filter_scalar(ChannelFilter& filter, const float x) noexcept
+    {
+        const auto y = filter.gain * x - filter.dc_gain * filter.last_input + filter.pole_powers[0] * filter.last_output;
+        const auto out = y - filter.emphasis * filter.last_output;
+
+        filter.last_input = x;
+        filter.last_output = y;
+
+        return out;
+    }
+
+    template<class Load, int Channels>
+    void mix_filter_tail(const uint8_t* RESTRICT src, const int channels, const ChannelRouting& routing,
+                         ChannelFilter* filters, float* const* planes, const size_t start, const size_t frames)
+    {
+        const auto count = 0 == Channels ? channels : Channels;
+        const auto taps = routing.taps();
+        const auto first_tap = routing.first_tap();
+        const auto outputs = routing.outputs();
+
+        for (auto i = start; i < frames; ++i)
+        {
+            const auto frame = src + i * count * Load::size;
+
+            for (auto o = 0; o < outputs; ++o)
+            {
+                auto sum = 0.0f;
+
+                for (auto t = first_tap[o]; t < first_tap[o + 1]; ++t)
+                    sum += taps[t].gain * Load::scalar(frame + taps[t].input * Load::size);
+
+                planes[o][i] = filter_scalar(filters[o], sum);
+            }
+        }
+    }
+
+    template<class Load, int Channels>
+    void mix_scalar(const void* src, const ChannelRouting& routing, float* const* planes, const size_t frames)
+    {
+        mix_tail<Load, Channels>(static_cast<const uint8_t*>(src), routing.inputs(), routing, planes, 0, frames);
+    }
+
+    template<class Load, int Channels>
+    void mix_filter_scalar(const void* src, const ChannelRouting& routing, ChannelFilter* filters,
+                           float* const* planes, const size_t frames)
+    {
+        const FlushDenormals flush;
+
+        mix_filter_tail<Load, Channels>(static_cast<const uint8_t*>(src), routing.inputs(), routing, filters,
+                                        planes, 0, frames);
+    }
+
+    template<class Load, int Channels>
+    void convert_scalar(const void* src, const int channels, float* const* planes, const size_t frames)
+    {
+        convert_tail<Load, Channels>(static_cast<const uint8_t*>(src), channels, planes, 0, frames);
+    }
+
+#if DEINTERLEAVE_X86
+
+    //
+    // float, SSE2
+    //
+
+    TARGET_SSE2 void deinterleave_float2_sse2(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const float*>(source);
+
+        const auto c0 = planes[0];
+        const auto c1 = planes[1];
+
+        size_t i = 0;
+
+        for (; i + 4 <= frames; i += 4)
+        {
+            const auto a = _mm_loadu_ps(src + 2 * i);
+            const auto b = _mm_loadu_ps(src + 2 * i + 4);
+
+            _mm_storeu_ps(c0 + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(c1 + i, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+
+        deinterleave_tail<float, 2>(src, planes, i, frames);
+    }
+
+    TARGET_SSE2 void deinterleave_float4_sse2(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const float*>(source);
+
+        size_t i = 0;
+
+        for (; i + 4 <= frames; i += 4)
+        {
+            auto r0 = _mm_loadu_ps(src + 4 * i);
+            auto r1 = _mm_loadu_ps(src + 4 * i + 4);
+            auto r2 = _mm_loadu_ps(src + 4 * i + 8);
+            auto r3 = _mm_loadu_ps(src + 4 * i + 12);
+
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+            _mm_storeu_ps(planes[0] + i, r0);
+            _mm_storeu_ps(planes[1] + i, r1);
+            _mm_storeu_ps(planes[2] + i, r2);
+            _mm_storeu_ps(planes[3] + i, r3);
+        }
+
+        deinterleave_tail<float, 4>(src, planes, i, frames);
+    }
+
+    TARGET_SSE2 void deinterleave_float6_sse2(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const float*>(source);
+
+        size_t i = 0;
+
+        for (; i + 4 <= frames; i += 4)
+        {
+            const auto p = src + 6 * i;
+
+            // Channels 0-3 of each frame; the loads overlap the next frame.
+            auto r0 = _mm_loadu_ps(p);
+            auto r1 = _mm_loadu_ps(p + 6);
+            auto r2 = _mm_loadu_ps(p + 12);
+            auto r3 = _mm_loadu_ps(p + 18);
+
+            _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+            _mm_storeu_ps(planes[0] + i, r0);
+            _mm_storeu_ps(planes[1] + i, r1);
+            _mm_storeu_ps(planes[2] + i, r2);
+            _mm_storeu_ps(planes[3] + i, r3);
+
+            // Channels 4-5, two frames per register.
+            auto lo = _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(p + 4));
+            lo = _mm_loadh_pi(lo, reinterpret_cast<const __m64*>(p + 10));
+            auto hi = _mm_loadl_pi(_mm_setzero_ps(), reinterpret_cast<const __m64*>(p + 16));
+            hi = _mm_loadh_pi(hi, reinterpret_cast<const __m64*>(p + 22));
+
+            _mm_storeu_ps(planes[4] + i, _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0)));
+            _mm_storeu_ps(planes[5] + i, _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1)));
+        }
+
+        deinterleave_tail<float, 6>(src, planes, i, frames);
+    }
+
+    TARGET_SSE2 void deinterleave_float8_sse2(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const float*>(source);
+
+        size_t i = 0;
+
+        for (; i + 4 <= frames; i += 4)
+        {
+            for (auto half = 0; half < 8; half += 4)
+            {
+                const auto p = src + 8 * i + half;
+
+                auto r0 = _mm_loadu_ps(p);
+                auto r1 = _mm_loadu_ps(p + 8);
+                auto r2 = _mm_loadu_ps(p + 16);
+                auto r3 = _mm_loadu_ps(p + 24);
+
+                _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+
+                _mm_storeu_ps(planes[half + 0] + i, r0);
+                _mm_storeu_ps(planes[half + 1] + i, r1);
+                _mm_storeu_ps(planes[half + 2] + i, r2);
+                _mm_storeu_ps(planes[half + 3] + i, r3);
+            }
+        }
+
+        deinterleave_tail<float, 8>(src, planes, i, frames);
+    }
+
+    //
+    // AVX2.  The kernels are written against a loader that turns eight
+    // consecutive samples of some format into floats, so conversion happens in
+    // registers on the way through the transpose.
+    //
+
+    template<class Load, int Channels>
+    size_t vector_frames(const size_t frames)
+    {
+        // Whole blocks of eight frames whose loads, overread included, stay
+        // inside the source.  Six channel frames are loaded a row of eight
+        // samples each, so the last row runs two samples into the next frame.
+        const auto overread = Load::overread + (6 == Channels ? 2 * Load::size : 0);
+        const auto bytes = frames * Channels * Load::size;
+
+        if (bytes < overread)
+            return 0;
+
+        return (bytes - overread) / (Channels * Load::size) / 8 * 8;
+    }
+
+    // Reads eight frames at p and leaves channel c of them in ch[c].
+    template<class Load, int Channels>
+    TARGET_AVX2 inline void load_frames_avx2(const uint8_t* p, __m256* ch)
+    {
+        static_assert(1 == Channels || 2 == Channels || 4 == Channels || 6 == Channels || 8 == Channels,
+                      "1, 2, 4, 6 or 8 channels");
+
+        if (1 == Channels)
+        {
+            ch[0] = Load::load8(p);
+        }
+        else if (2 == Channels)
+        {
+            const auto a = Load::load8(p);
+            const auto b = Load::load8(p + 8 * Load::size);
+
+            // Frames 0, 1, 4, 5 and 2, 3, 6, 7, so the in-lane shuffles come
+            // out in order.
+            const auto lo = _mm256_permute2f128_ps(a, b, 0x20);
+            const auto hi = _mm256_permute2f128_ps(a, b, 0x31);
+
+            ch[0] = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+            ch[1] = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+        }
+        else if (4 == Channels)
+        {
+            const auto r0 = Load::load8(p);
+            const auto r1 = Load::load8(p + 8 * Load::size);
+            const auto r2 = Load::load8(p + 16 * Load::size);
+            const auto r3 = Load::load8(p + 24 * Load::size);
+
+            // Put frames 0-3 in the low lanes and 4-7 in the high lanes, then
+            // transpose each lane.
+            const auto f04 = _mm256_permute2f128_ps(r0, r2, 0x20);
+            const auto f15 = _mm256_permute2f128_ps(r0, r2, 0x31);
+            const auto f26 = _mm256_permute2f128_ps(r1, r3, 0x20);
+            const auto f37 = _mm256_permute2f128_ps(r1, r3, 0x31);
+
+            const auto t0 = _mm256_unpacklo_ps(f04, f15);
+            const auto t1 = _mm256_unpacklo_ps(f26, f37);
+            const auto t2 = _mm256_unpackhi_ps(f04, f15);
+            const auto t3 = _mm256_unpackhi_ps(f26, f37);
+
+            ch[0] = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+            ch[1] = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+            ch[2] = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+            ch[3] = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+        }
+        else
+        {
+            // One frame per row and an 8x8 transpose.  With six channels each
+            // row also picks up two samples of the next frame, which land in
+            // the unused channels 6 and 7.
+            __m256 u[8];
+
+            for (auto j = 0; j < 8; j += 4)
+            {
+                const auto r0 = Load::load8(p + Channels * j * Load::size);
+                const auto r1 = Load::load8(p + Channels * (j + 1) * Load::size);
+                const auto r2 = Load::load8(p + Channels * (j + 2) * Load::size);
+                const auto r3 = Load::load8(p + Channels * (j + 3) * Load::size);
+
+                const auto t0 = _mm256_unpacklo_ps(r0, r1);
+                const auto t1 = _mm256_unpackhi_ps(r0, r1);
+                const auto t2 = _mm256_unpacklo_ps(r2, r3);
+                const auto t3 = _mm256_unpackhi_ps(r2, r3);
+
+                u[j + 0] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+                u[j + 1] = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+                u[j + 2] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+                u[j + 3] = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+            }
+
+            // u[0..3] hold channels 0-3 (low lane) and 4-7 (high lane) of
+            // frames 0-3, u[4..7] the same for frames 4-7.
+            for (auto c = 0; c < 4; ++c)
+            {
+                ch[c] = _mm256_permute2f128_ps(u[c], u[c + 4], 0x20);
+
+                if (c + 4 < Channels)
+                    ch[c + 4] = _mm256_permute2f128_ps(u[c], u[c + 4], 0x31);
+            }
+        }
+    }
+
+    template<class Load, int Channels>
+    TARGET_AVX2 void convert_avx2(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const uint8_t*>(source);
+        const auto end = vector_frames<Load, Channels>(frames);
+
+        for (size_t i = 0; i < end; i += 8)
+        {
+            __m256 ch[Channels];
+
+            load_frames_avx2<Load, Channels>(src + Channels * i * Load::size, ch);
+
+            for (auto c = 0; c < Channels; ++c)
+                _mm256_storeu_ps(planes[c] + i, ch[c]);
+        }
+
+        convert_tail<Load, Channels>(src, Channels, planes, end, frames);
+    }
+
+    template<class Load, int Channels>
+    TARGET_AVX2 void mix_avx2(const void* source, const ChannelRouting& routing, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const uint8_t*>(source);
+        const auto end = vector_frames<Load, Channels>(frames);
+        const auto taps = routing.taps();
+        const auto first_tap = routing.first_tap();
+        const auto outputs = routing.outputs();
+
+        for (size_t i = 0; i < end; i += 8)
+        {
+            __m256 ch[Channels];
+
+            load_frames_avx2<Load, Channels>(src + Channels * i * Load::size, ch);
+
+            for (auto o = 0; o < outputs; ++o)
+            {
+                auto sum = _mm256_setzero_ps();
+
+                for (auto t = first_tap[o]; t < first_tap[o + 1]; ++t)
+                    sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(taps[t].gain), ch[taps[t].input]));
+
+                _mm256_storeu_ps(planes[o] + i, sum);
+            }
+        }
+
+        mix_tail<Load, Channels>(src, Channels, routing, planes, end, frames);
+    }
+
+    // Runs a ChannelFilter over eight consecutive samples x.  last_input and
+    // last_output hold the previous x and y in every lane and are updated.
+    TARGET_AVX2 inline __m256 filter_avx2(const ChannelFilter& filter, const __m256 x, __m256& last_input,
+                                          __m256& last_output)
+    {
+        const auto zero = _mm256_setzero_ps();
+        const auto up1 = _mm256_setr_epi32(0, 0, 1, 2, 3, 4, 5, 6);
+        const auto top = _mm256_set1_epi32(7);
+
+        auto y = _mm256_mul_ps(_mm256_set1_ps(filter.gain), x);
+
+        if (filter.dc_block)
+        {
+            const auto up2 = _mm256_setr_epi32(0, 0, 0, 1, 2, 3, 4, 5);
+            const auto up4 = _mm256_setr_epi32(0, 0, 0, 0, 0, 1, 2, 3);
+            const auto& pole = filter.pole_powers;
+
+            const auto previous = _mm256_blend_ps(_mm256_permutevar8x32_ps(x, up1), last_input, 0x01);
+
+            y = _mm256_sub_ps(y, _mm256_mul_ps(_mm256_set1_ps(filter.dc_gain), previous));
+
+            // y[k] += pole * y[k - 1] is a prefix scan over the eight lanes:
+            // three shifted adds cover it, then the last block's y comes in
+            // through pole^(k + 1).
+            y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(pole[0]),
+                                               _mm256_blend_ps(_mm256_permutevar8x32_ps(y, up1), zero, 0x01)));
+            y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(pole[1]),
+                                               _mm256_blend_ps(_mm256_permutevar8x32_ps(y, up2), zero, 0x03)));
+            y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_set1_ps(pole[3]),
+                                               _mm256_blend_ps(_mm256_permutevar8x32_ps(y, up4), zero, 0x0f)));
+            y = _mm256_add_ps(y, _mm256_mul_ps(_mm256_loadu_ps(pole.data()), last_output));
+        }
+
+        auto out = y;
+
+        if (0.0f != filter.emphasis)
+        {
+            const auto previous = _mm256_blend_ps(_mm256_permutevar8x32_ps(y, up1), last_output, 0x01);
+
+            out = _mm256_sub_ps(y, _mm256_mul_ps(_mm256_set1_ps(filter.emphasis), previous));
+        }
+
+        last_input = _mm256_permutevar8x32_ps(x, top);
+        last_output = _mm256_permutevar8x32_ps(y, top);
+
+        return out;
+    }
+
+    template<class Load, int Channels>
+    TARGET_AVX2 void mix_filter_avx2(const void* source, const ChannelRouting& routing, ChannelFilter* filters,
+                                     float* const* planes, const size_t frames)
+    {
+        // The filter state stays in registers across the loop, for at most
+        // this many outputs.
+        static const auto max_outputs = 8;
+
+        const FlushDenormals flush;
+        const auto src = static_cast<const uint8_t*>(source);
+        const auto taps = routing.taps();
+        const auto first_tap = routing.first_tap();
+        const auto outputs = routing.outputs();
+        const auto end = outputs <= max_outputs ? vector_frames<Load, Channels>(frames) : 0;
+
+        if (end > 0)
+        {
+            __m256 last_input[max_outputs];
+            __m256 last_output[max_outputs];
+
+            for (auto o = 0; o < outputs; ++o)
+            {
+                last_input[o] = _mm256_set1_ps(filters[o].last_input);
+                last_output[o] = _mm256_set1_ps(filters[o].last_output);
+            }
+
+            for (size_t i = 0; i < end; i += 8)
+            {
+                __m256 ch[Channels];
+
+                load_frames_avx2<Load, Channels>(src + Channels * i * Load::size, ch);
+
+                for (auto o = 0; o < outputs; ++o)
+                {
+                    auto sum = _mm256_setzero_ps();
+
+                    for (auto t = first_tap[o]; t < first_tap[o + 1]; ++t)
+                        sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(taps[t].gain), ch[taps[t].input]));
+
+                    _mm256_storeu_ps(planes[o] + i, filter_avx2(filters[o], sum, last_input[o], last_output[o]));
+                }
+            }
+
+            for (auto o = 0; o < outputs; ++o)
+            {
+                filters[o].last_input = _mm_cvtss_f32(_mm256_castps256_ps128(last_input[o]));
+                filters[o].last_output = _mm_cvtss_f32(_mm256_castps256_ps128(last_output[o]));
+            }
+        }
+
+        mix_filter_tail<Load, Channels>(src, Channels, routing, filters, planes, end, frames);
+    }
+
+    //
+    // float, AVX-512
+    //
+
+    // Splits the 32 samples in a:b into the even and odd ones.  Each split
+    // halves the channel stride, so log2(channels) rounds leave one channel
+    // per register.
+    TARGET_AVX512 inline void split_avx512(const __m512 a, const __m512 b, __m512& even, __m512& odd)
+    {
+        const auto even_index = _mm512_set_epi32(30, 28, 26, 24, 22, 20, 18, 16, 14, 12, 10, 8, 6, 4, 2, 0);
+        const auto odd_index = _mm512_set_epi32(31, 29, 27, 25, 23, 21, 19, 17, 15, 13, 11, 9, 7, 5, 3, 1);
+
+        even = _mm512_permutex2var_ps(a, even_index, b);
+        odd = _mm512_permutex2var_ps(a, odd_index, b);
+    }
+
+    TARGET_AVX512 void deinterleave_float2_avx512(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const float*>(source);
+
+        size_t i = 0;
+
+        for (; i + 16 <= frames; i += 16)
+        {
+            __m512 c0, c1;
+
+            split_avx512(_mm512_loadu_ps(src + 2 * i), _mm512_loadu_ps(src + 2 * i + 16), c0, c1);
+
+            _mm512_storeu_ps(planes[0] + i, c0);
+            _mm512_storeu_ps(planes[1] + i, c1);
+        }
+
+        deinterleave_tail<float, 2>(src, planes, i, frames);
+    }
+
+    TARGET_AVX512 void deinterleave_float4_avx512(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const float*>(source);
+
+        size_t i = 0;
+
+        for (; i + 16 <= frames; i += 16)
+        {
+            const auto p = src + 4 * i;
+
+            __m512 e0, o0, e1, o1;
+
+            split_avx512(_mm512_loadu_ps(p), _mm512_loadu_ps(p + 16), e0, o0);
+            split_avx512(_mm512_loadu_ps(p + 32), _mm512_loadu_ps(p + 48), e1, o1);
+
+            __m512 c0, c1, c2, c3;
+
+            split_avx512(e0, e1, c0, c2);
+            split_avx512(o0, o1, c1, c3);
+
+            _mm512_storeu_ps(planes[0] + i, c0);
+            _mm512_storeu_ps(planes[1] + i, c1);
+            _mm512_storeu_ps(planes[2] + i, c2);
+            _mm512_storeu_ps(planes[3] + i, c3);
+        }
+
+        deinterleave_tail<float, 4>(src, planes, i, frames);
+    }
+
+    TARGET_AVX512 void deinterleave_float8_avx512(const void* source, int, float* const* planes, const size_t frames)
+    {
+        const auto src = static_cast<const float*>(source);
+
+        size_t i = 0;
+
+        for (; i + 16 <= frames; i += 16)
+        {
+            const auto p = src + 8 * i;
+
+            // Even channels (0, 2, 4, 6) and odd channels, stride four.
+            __m512 e0, o0, e1, o1, e2, o2, e3, o3;
+
+            split_avx512(_mm512_loadu_ps(p), _mm512_loadu_ps(p + 16), e0, o0);
+            split_avx512(_mm512_loadu_ps(p + 32), _mm512_loadu_ps(p + 48), e1, o1);
+            split_avx512(_mm512_loadu_ps(p + 64), _mm512_loadu_ps(p + 80), e2, o2);
+            split_avx512(_mm512_loadu_ps(p + 96), _mm512_loadu_ps(p + 112), e3, o3);
+
+            // Channels 0, 4 / 2, 6 / 1, 5 / 3, 7, stride two.
+            __m512 c04a, c04b, c26a, c26b, c15a, c15b, c37a, c37b;
+
+            split_avx512(e0, e1, c04a, c26a);
+            split_avx512(e2, e3, c04b, c26b);
+            split_avx512(o0, o1, c15a, c37a);
+            split_avx512(o2, o3, c15b, c37b);
+
+            __m512 c[8];
+
+            split_avx512(c04a, c04b, c[0], c[4]);
+            split_avx512(c26a, c26b, c[2], c[6]);
+            split_avx512(c15a, c15b, c[1], c[5]);
+            split_avx512(c37a, c37b, c[3], c[7]);
+
+            for (auto j = 0; j < 8; ++j)
+                _mm512_storeu_ps(planes[j] + i, c[j]);
+        }
+
+        deinterleave_tail<float, 8>(src, planes, i, frames);
+    }
+
+#endif // DEINTERLEAVE_X86
+
+    template<class Load>
+    deinterleave_fn<float> find_convert(const int channels) noexcept
+    {
+#if DEINTERLEAVE_X86
+        if (simd_level() >= SimdLevel::avx2)
+        {
+            switch (channels)
+            {
+            case 1: return &convert_avx2<Load, 1>;
+            case 2: return &convert_avx2<Load, 2>;
+            case 4: return &convert_avx2<Load, 4>;
+            case 6: return &convert_avx2<Load, 6>;
+            case 8: return &convert_avx2<Load, 8>;
+            default: break;
+            }
+        }
+#endif
+
+        switch (channels)
+        {
+        case 1: return &convert_scalar<Load, 1>;
+        case 2: return &convert_scalar<Load, 2>;
+        case 4: return &convert_scalar<Load, 4>;
+        case 6: return &convert_scalar<Load, 6>;
+        case 8: return &convert_scalar<Load, 8>;
+        default: return &convert_scalar<Load, 0>;
+        }
+    }
+
+    template<class Load>
+    mix_fn find_mix(const int channels) noexcept
+    {
+#if DEINTERLEAVE_X86
+        if (simd_level() >= SimdLevel::avx2)
+        {
+            switch (channels)
+            {
+            case 1: return &mix_avx2<Load, 1>;
+            case 2: return &mix_avx2<Load, 2>;
+            case 4: return &mix_avx2<Load, 4>;
+            case 6: return &mix_avx2<Load, 6>;
+            case 8: return &mix_avx2<Load, 8>;
+            default: break;
+            }
+        }
+#endif
+
+        switch (channels)
+        {
+        case 1: return &mix_scalar<Load, 1>;
+        case 2: return &mix_scalar<Load, 2>;
+        case 4: return &mix_scalar<Load, 4>;
+        case 6: return &mix_scalar<Load, 6>;
+        case 8: return &mix_scalar<Load, 8>;
+        default: return &mix_scalar<Load, 0>;
+        }
+    }
+
+    template<class Load>
+    mix_filter_fn find_mix_filter(const int channels) noexcept
+    {
+#if DEINTERLEAVE_X86
+        if (simd_level() >= SimdLevel::avx2)
+        {
+            switch (channels)
+            {
+            case 1: return &mix_filter_avx2<Load, 1>;
+            case 2: return &mix_filter_avx2<Load, 2>;
+            case 4: return &mix_filter_avx2<Load, 4>;
+            case 6: return &mix_filter_avx2<Load, 6>;
+            case 8: return &mix_filter_avx2<Load, 8>;
+            default: break;
+            }
+        }
+#endif
+
+        switch (channels)
+        {
+        case 1: return &mix_filter_scalar<Load, 1>;
+        case 2: return &mix_filter_scalar<Load, 2>;
+        case 4: return &mix_filter_scalar<Load, 4>;
+        case 6: return &mix_filter_scalar<Load, 6>;
+        case 8: return &mix_filter_scalar<Load, 8>;
+        default: return &mix_filter_scalar<Load, 0>;
+        }
+    }
+}
+
+SimdLevel simd_level() noexcept
+{
+    static const auto level = detect_simd_level();
+
+    return level;
+}
+
+// Layouts without a kernel at some level use the next level down.  Six
+// channel frames don't tile a 512-bit register, so AVX-512 machines take the
+// AVX2 kernel for them.
+
+deinterleave_fn<float> Deinterleave<float>::find(const int channels) noexcept
+{
+#if DEINTERLEAVE_X86
+    const auto level = simd_level();
+
+    switch (channels)
+    {
+    case 2:
+        if (level >= SimdLevel::avx512)
+            return &deinterleave_float2_avx512;
+        if (level >= SimdLevel::avx2)
+            return &convert_avx2<LoadFloat32, 2>;
+        if (level >= SimdLevel::sse2)
+            return &deinterleave_float2_sse2;
+        break;
+    case 4:
+        if (level >= SimdLevel::avx512)
+            return &deinterleave_float4_avx512;
+        if (level >= SimdLevel::avx2)
+            return &convert_avx2<LoadFloat32, 4>;
+        if (level >= SimdLevel::sse2)
+            return &deinterleave_float4_sse2;
+        break;
+    case 6:
+        if (level >= SimdLevel::avx2)
+            return &convert_avx2<LoadFloat32, 6>;
+        if (level >= SimdLevel::sse2)
+            return &deinterleave_float6_sse2;
+        break;
+    case 8:
+        if (level >= SimdLevel::avx512)
+            return &deinterleave_float8_avx512;
+        if (level >= SimdLevel::avx2)
+            return &convert_avx2<LoadFloat32, 8>;
+        if (level >= SimdLevel::sse2)
+            return &deinterleave_float8_sse2;
+        break;
+    default:
+        break;
+    }
+#endif
+
+    return find_scalar<float>(channels);
+}
+
+deinterleave_fn<float> Deinterleave<float>::find(const SampleFormat format, const int channels) noexcept
+{
+    switch (format)
+    {
+    case SampleFormat::int16: return find_convert<LoadInt16>(channels);
+    case SampleFormat::int24: return find_convert<LoadInt24>(channels);
+    case SampleFormat::int32: return find_convert<LoadInt32>(channels);
+    case SampleFormat::float64: return find_convert<LoadFloat64>(channels);
+    case SampleFormat::float32:
+    default:
+        return find(channels);
+    }
+}
+
+size_t sample_size(const SampleFormat format) noexcept
+{
+    switch (format)
+    {
+    case SampleFormat::int16: return 2;
+    case SampleFormat::int24: return 3;
+    case SampleFormat::int32: return 4;
+    case SampleFormat::float32: return 4;
+    case SampleFormat::float64: return 8;
+    default: return 0;
+    }
+}
+
+mix_fn Mix::find(const SampleFormat format, const int channels) noexcept
+{
+    switch (format)
+    {
+    case SampleFormat::int16: return find_mix<LoadInt16>(channels);
+    case SampleFormat::int24: return find_mix<LoadInt24>(channels);
+    case SampleFormat::int32: return find_mix<LoadInt32>(channels);
+    case SampleFormat::float64: return find_mix<LoadFloat64>(channels);
+    case SampleFormat::float32:
+    default:
+        return find_mix<LoadFloat32>(channels);
+    }
+}
+
+mix_filter_fn Mix::find_filtered(const SampleFormat format, const int channels) noexcept
+{
+    switch (format)
+    {
+    case SampleFormat::int16: return find_mix_filter<LoadInt16>(channels);
+    case SampleFormat::int24: return find_mix_filter<LoadInt24>(channels);
+    case SampleFormat::int32: return find_mix_filter<LoadInt32>(channels);
+    case SampleFormat::float64: return find_mix_filter<LoadFloat64>(channels);
+    case SampleFormat::float32:
+    default:
+        return find_mix_filter<LoadFloat32>(channels);
+    }
+}
+
+ChannelRouting::ChannelRouting(const int inputs, const int outputs, std::vector<float> gains)
+    : inputs_{ inputs }, outputs_{ outputs }, gains_{ std::move(gains) }
+{
+    if (inputs < 1 || outputs < 1 || gains_.size() != static_cast<size_t>(inputs) * outputs)
+        throw std::invalid_argument("ChannelRouting: gains must be outputs x inputs");
+
+    first_tap_.reserve(outputs + 1);
+
+    for (auto o = 0; o < outputs; ++o)
+    {
+        first_tap_.push_back(static_cast<int>(taps_.size()));
+
+        for (auto i = 0; i < inputs; ++i)
+        {
+            const auto gain = gains_[o * inputs + i];
+
+            if (0 != gain)
+                taps_.push_back(Tap{ i, gain });
+        }
+    }
+
+    first_tap_.push_back(static_cast<int>(taps_.size()));
+}
+
+ChannelRouting ChannelRouting::identity(const int channels)
+{
+    std::vector<float> gains(static_cast<size_t>(channels) * channels);
+
+    for (auto c = 0; c < channels; ++c)
+        gains[c * channels + c] = 1;
+
+    return ChannelRouting{ channels, channels, std::move(gains) };
+}
+
+ChannelRouting ChannelRouting::select(const int inputs, const std::vector<int>& channels)
+{
+    std::vector<float> gains(inputs * channels.size());
+
+    for (size_t o = 0; o < channels.size(); ++o)
+    {
+        if (channels[o] < 0 || channels[o] >= inputs)
+            throw std::out_of_range("ChannelRouting: no such input channel");
+
+        gains[o * inputs + channels[o]] = 1;
+    }
+
+    return ChannelRouting{ inputs, static_cast<int>(channels.size()), std::move(gains) };
+}
+
+ChannelRouting ChannelRouting::mono(const int inputs)
+{
+    return ChannelRouting{ inputs, 1, std::vector<float>(inputs, 1.0f / inputs) };
+}
+
+ChannelRouting ChannelRouting::mid_side(const int inputs, const int left, const int right)
+{
+    if (left < 0 || left >= inputs || right < 0 || right >= inputs)
+        throw std::out_of_range("ChannelRouting: no such input channel");
+
+    std::vector<float> gains(2 * inputs);
+
+    gains[left] += 0.5f;
+    gains[right] += 0.5f;
+    gains[inputs + left] += 0.5f;
+    gains[inputs + right] -= 0.5f;
+
+    return ChannelRouting{ inputs, 2, std::move(gains) };
+}
+
+bool ChannelRouting::is_identity() const noexcept
+{
+    if (inputs_ != outputs_)
+        return false;
+
+    for (auto o = 0; o < outputs_; ++o)
+    {
+        for (auto i = 0; i < inputs_; ++i)
+        {
+            if (gains_[o * inputs_ + i] != (o == i ? 1.0f : 0.0f))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+ChannelFilter::ChannelFilter(const Preprocessing& settings)
+    : gain{ settings.gain }, dc_block{ settings.dc_block }, dc_gain{ settings.dc_block ? settings.gain : 0.0f },
+      emphasis{ settings.emphasis }
+{
+    if (!settings.dc_block)
+        return;
+
+    if (!(settings.dc_pole >= 0.0f && settings.dc_pole < 1.0f))
+        throw std::invalid_argument("ChannelFilter: dc_pole must be in [0, 1)");
+
+    auto power = settings.dc_pole;
+
+    for (auto& p : pole_powers)
+    {
+        p = power;
+        power *= settings.dc_pole;
+    }
+}
+
+bool ChannelFilter::settle() noexcept
+{
+    static const auto quiet = 1e-7f;
+
+    if (!(last_input > -quiet && last_input < quiet && last_output > -quiet && last_output < quiet))
+        return false;
+
+    reset();
+
+    return true;
+}
+
+void ChannelFilter::apply(float* samples, const size_t frames) noexcept
+{
+    const FlushDenormals flush;
+
+    for (size_t i = 0; i < frames; ++i)
+        samples[i] = filter_scalar(*this, samples[i]);
+}
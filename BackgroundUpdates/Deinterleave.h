@@ -0,0 +1,155 @@
+﻿#pragma once
+
+// Interleaved, little-endian sample formats.  int24 is packed three bytes
+// per sample.
+enum class SampleFormat
+{
+    int16,
+    int24,
+    int32,
+    float32,
+    float64
+};
+
+size_t sample_size(SampleFormat format) noexcept;
+
+// Splits frames of interleaved samples into one plane per channel:
+// planes[c][i] = src[i * channels + c].  The planes need not be aligned.
+template<typename T>
+using deinterleave_fn = void (*)(const void* src, int channels, T* const* planes, size_t frames);
+
+template<typename T>
+void deinterleave_generic(const void* source, const int channels, T* const* planes, const size_t frames)
+{
+    auto src = static_cast<const T*>(source);
+
+    for (size_t i = 0; i < frames; ++i)
+    {
+        for (auto c = 0; c < channels; ++c)
+            planes[c][i] = *src++;
+    }
+}
+
+// find() picks the fastest kernel for a channel count on this CPU.  Call it
+// once, when the format is known, and keep the pointer.  Types without hand
+// written kernels get the generic loop.
+template<typename T>
+struct Deinterleave
+{
+    static deinterleave_fn<T> find(int) noexcept { return &deinterleave_generic<T>; }
+};
+
+// The format overload converts to float in [-1, 1) on the way through, so
+// integer and double sources take one pass instead of two.
+template<>
+struct Deinterleave<float>
+{
+    static deinterleave_fn<float> find(int channels) noexcept;
+    static deinterleave_fn<float> find(SampleFormat format, int channels) noexcept;
+};
+
+// Output channel o is the sum over inputs i of gain(o, i) * input i.  Inputs
+// with zero gain in every output are never read.
+class ChannelRouting final
+{
+public:
+    struct Tap
+    {
+        int input;
+        float gain;
+    };
+
+    // gains is outputs x inputs, row major.
+    ChannelRouting(int inputs, int outputs, std::vector<float> gains);
+
+    static ChannelRouting identity(int channels);
+    // Output o is input channels[o].
+    static ChannelRouting select(int inputs, const std::vector<int>& channels);
+    // The average of all inputs.
+    static ChannelRouting mono(int inputs);
+    // (left + right) / 2 and (left - right) / 2.
+    static ChannelRouting mid_side(int inputs, int left = 0, int right = 1);
+
+    int inputs() const noexcept { return inputs_; }
+    int outputs() const noexcept { return outputs_; }
+    float gain(const int output, const int input) const noexcept { return gains_[output * inputs_ + input]; }
+    bool is_identity() const noexcept;
+
+    // The nonzero gains of output o are taps()[first_tap()[o] .. first_tap()[o + 1]).
+    const Tap* taps() const noexcept { return taps_.data(); }
+    const int* first_tap() const noexcept { return first_tap_.data(); }
+private:
+    int inputs_;
+    int outputs_;
+    std::vector<float> gains_;
+    std::vector<Tap> taps_;
+    std::vector<int> first_tap_;
+};
+
+// First-order conditioning for one output channel, applied in this order:
+//     gain          x[n] = gain * in[n]
+//     DC blocking   y[n] = x[n] - x[n-1] + dc_pole * y[n-1]
+//     pre-emphasis  out[n] = y[n] - emphasis * y[n-1]
+// The defaults pass samples through unchanged.
+struct Preprocessing
+{
+    float gain = 1.0f;
+    bool dc_block = false;
+    float dc_pole = 0.995f;
+    float emphasis = 0.0f;
+};
+
+// Preprocessing's coefficients, plus the state one call leaves for the next so
+// that consecutive calls filter one continuous signal.
+struct ChannelFilter
+{
+    ChannelFilter() = default;
+    // Throws unless 0 <= dc_pole < 1.
+    explicit ChannelFilter(const Preprocessing& settings);
+
+    float gain = 1.0f;
+    bool dc_block = false;
+    // gain when DC blocking, otherwise 0.
+    float dc_gain = 0.0f;
+    // dc_pole to the 1st through 8th powers, for filtering eight samples at
+    // a time.
+    std::array<float, 8> pole_powers{};
+    float emphasis = 0.0f;
+
+    // The previous input (before gain) and the previous y.
+    float last_input = 0.0f;
+    float last_output = 0.0f;
+
+    bool is_identity() const noexcept { return 1.0f == gain && !dc_block && 0.0f == emphasis; }
+    void reset() noexcept { last_input = 0.0f; last_output = 0.0f; }
+    // Zeroes state that has decayed below -140 dBFS.  True if the state is
+    // now zero, so silence in gives silence out.
+    bool settle() noexcept;
+    // In place, one sample at a time.
+    void apply(float* samples, size_t frames) noexcept;
+};
+
+// Converts to float and applies a routing in the same pass as the
+// deinterleave.  planes has routing.outputs() entries.
+typedef void (*mix_fn)(const void* src, const ChannelRouting& routing, float* const* planes, size_t frames);
+// The same, with filters[o] run over output o before it is stored.
+typedef void (*mix_filter_fn)(const void* src, const ChannelRouting& routing, ChannelFilter* filters,
+                              float* const* planes, size_t frames);
+
+struct Mix
+{
+    // channels is the number of interleaved input channels.
+    static mix_fn find(SampleFormat format, int channels) noexcept;
+    static mix_filter_fn find_filtered(SampleFormat format, int channels) noexcept;
+};
+
+enum class SimdLevel
+{
+    none,
+    sse2,
+    avx2,
+    avx512
+};
+
+// What the CPU (and OS) support, detected once.
+SimdLevel simd_level() noexcept;
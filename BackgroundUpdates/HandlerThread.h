@@ -104,7 +104,7 @@ public:
             return false;
 
         if (flags_.test(signal))
-            return;
+            return true;
 
         flags_.set(signal);
 
@@ -4,8 +4,12 @@
 #include <functiondiscoverykeys.h>
 
 #include "MainWorker.h"
+#include "AudioDemux.h"
 #include "BufferPool.h"
+#include "CaptureRing.h"
+#include "SizeClassPool.h"
 #include "WASAPICapture.h"
+#include "WavRecorder.h"
 #include "thread_pool_enqueue.h"
 
 #if defined(_MSC_VER) && _MSC_VER >= 1800
@@ -16,140 +20,6 @@
 #define RESTRICT
 #endif
 
-template<typename T, size_t Size, int Align>
-struct alignas(Align)
-    AudioBuffer
-{
-    int length;
-    alignas(Align)
-        std::array<T, Size> data;
-
-    void reset() { length = 0; }
-};
-
-template<typename T, size_t Size, int Align>
-class AudioDemux
-{
-public:
-    typedef BufferPool<AudioBuffer<T, Size, Align>, Align> pool_type;
-
-    AudioDemux(std::shared_ptr<pool_type> pool, const int channels)
-        : pool_(std::move(pool)), channels_(channels)
-    { }
-    AudioDemux() = delete;
-    AudioDemux(const AudioDemux &) = delete;
-
-    void add(const void* data, const size_t data_size);
-
-    int channels() const noexcept { return channels_; }
-
-private:
-    std::shared_ptr<pool_type> pool_;
-    const int channels_;
-};
-
-template<typename T, size_t Size, int Align>
-void AudioDemux<T, Size, Align>::add(const void* data, const size_t data_size)
-{
-    if (data_size < sizeof(T) * channels_)
-        return;
-
-    auto item_count = data_size / sizeof(T);
-    auto block_count = item_count / channels_;
-
-    auto buffer_size =  Size;
-
-    if (!data)
-    {
-        decltype(buffer_size) written = 0;
-
-        for(;;)
-        {
-            const auto length = std::min(buffer_size, item_count - written);
-
-            if (length <= 0)
-                return;
-
-            for (auto i = 0; i < channels_; ++i)
-            {
-                auto buffer = pool_->allocate();
-
-                memset(&buffer->data[0], 0, sizeof(T) * length);
-
-                buffer->length = length;
-
-                // Enqueue buffer
-            }
-
-            written += length;
-        }
-    }
-
-    std::vector<typename pool_type::unique_ptr_type> buffers;
-
-    buffers.reserve(channels_);
-
-    for (auto i = 0; i < channels_; ++i)
-    {
-        buffers.push_back(pool_->allocate());
-
-        if (!*buffers.rbegin())
-            return;
-    }
-
-    auto p = reinterpret_cast<const T* RESTRICT>(data);
-    auto p_end = p + item_count;
-
-    auto index = 0;
-
-    while (p < p_end)
-    {
-        if (index >= buffer_size)
-        {
-            for (auto& b : buffers)
-            {
-                b->length = index;
-
-                auto full = std::move(b);
-
-                b = pool_->allocate();
-
-                if (!b)
-                    return;
-
-                // Enqueue "full"
-            }
-        }
-
-        const auto remaining_output = buffer_size - index;
-        const auto remaining_input = (p_end - p) / channels_;
-        const auto length = std::min<size_t>(remaining_output, remaining_input);
-
-        if (length < 1)
-            break;      // TODO: Partial data remaining?
-
-        for (auto i = 0; i < length; ++i)
-        {
-            for (auto& b : buffers)
-                b->data[index] = *p++;
-
-            ++index;
-        }
-    }
-
-    if (index > 0)
-    {
-        for (auto& b : buffers)
-        {
-            b->length = index;
-
-            auto full = std::move(b);
-
-            // Enqueue "full"
-        }
-    }
-}
-
 bool DisableMMCSS;
 
 namespace
@@ -351,7 +221,7 @@ namespace
     }
 }
 
-MainWorker::MainWorker() : main_thread_{}, audio_capture_{}, float_pool_{}, short_pool_{}
+MainWorker::MainWorker() : main_thread_{}, audio_capture_{}, float_pool_{}
 {
     Init();
 }
@@ -375,6 +245,16 @@ MainWorker::~MainWorker()
             // We shouldn't have to worry about COM ->Release() races, since all
             // the mangement work should be happening on our main_thread_.
             audio_capture_->Shutdown();
+
+            // The capture thread is gone; drain what it left in the ring
+            // before the demuxer goes away.
+            capture_ring_.reset();
+
+            if (recorder_)
+            {
+                DrainAudio();
+                CloseRecording();
+            }
         });
 
         audio_stop_future.wait();
@@ -444,31 +324,268 @@ void MainWorker::Start()
         if (!audio_capture_->Initialize(TargetLatency))
             return;
 
-        const auto wave_format = audio_capture_->MixFormat();
+        audio_started_ = StartCapture(*audio_capture_.Get());
+    });
+}
 
-        // TODO: Do stuff to see what the format really is.
-        // For now, assume 32-bit float.
+// Everything from here on only sees the CaptureSource.
+bool MainWorker::StartCapture(CaptureSource& source)
+{
+    main_thread_.verify_on_thread();
+
+    const auto format = source.Format();
+    const auto channels = source.ChannelCount();
+
+    sample_rate_ = source.SamplesPerSecond();
 
-        const auto channels = audio_capture_->ChannelCount();
+    if (!float_pools_)
+    {
+        float_pool_type::Config config;
+
+        config.buffer_count = 16;
+        config.magazine_size = 2;
+        config.max_count = 64;
+        config.grow_chunk = 8;
+        config.low_watermark = 4;
+        config.high_watermark = 32;
+        config.slab = true;
+        config.huge_pages = true;
+        config.lock_memory = true;
+        config.prefault = true;
+
+        // From 256 frames of mono up to 8192 frames of eight channels.
+        float_pools_ = std::make_unique<SizeClassPool<float_block_type, 32>>(config,
+            float_block_type::payload_size(1, 256), float_block_type::payload_size(8, 8192));
+
+        // The capture thread only asks for a refill; the buffers are
+        // allocated over here.
+        refill_signal_ = main_thread_.add_signal([this]()
+        {
+            float_pools_->maintain();
+        });
 
-        if (!float_demux_ || float_demux_->channels() != channels)
+        if (refill_signal_ >= 0)
         {
-            if (!float_pool_)
-                float_pool_ = std::make_shared<BufferPool<AudioBuffer<float, 4096, 32>, 32>>(32);
+            const auto refill_signal = refill_signal_;
 
-            float_demux_ = std::make_unique<AudioDemux<float, 4096, 32>>(float_pool_, channels);
+            float_pools_->set_refill_handler([this, refill_signal]()
+            {
+                main_thread_.request_signal(refill_signal);
+            });
         }
+    }
+
+    // Each block holds every channel for about a device period, rounded up to
+    // the next size class, so memory follows the packets the source delivers.
+    const auto payload_size = float_block_type::payload_size(channels, std::max(source.PeriodFrames(), 1u));
+
+    if (0 == float_pools_->class_size(payload_size))
+    {
+        printf("No block size for %d channels of %u frames\n", channels, source.PeriodFrames());
+        return false;
+    }
+
+    auto pool = float_pools_->pool_for(payload_size);
+
+    if (!float_demux_ || pool != float_pool_ || float_demux_->input_channels() != channels || float_demux_->format() != format)
+    {
+        float_pool_ = std::move(pool);
+
+        if (!float_pool_->resident())
+            printf("Float pool memory is not resident\n");
+
+        float_demux_ = AudioDemux<float, 32>::create(float_pool_, format, channels);
+
+        Preprocessing preprocessing;
+
+        preprocessing.dc_block = true;
+
+        float_demux_->set_preprocessing(preprocessing);
+
+        if (audio_signal_ < 0)
+            audio_signal_ = main_thread_.add_signal([this]() { DrainAudio(); });
 
-        audio_started_ = audio_capture_->Start([this](const uint8_t* p, size_t s)
+        if (audio_signal_ >= 0)
         {
-            if (s <= 0)
-                return;
+            const auto audio_signal = audio_signal_;
 
-            float_demux_->add(p, s);
-        });
+            float_demux_->set_ready_handler([this, audio_signal]()
+            {
+                main_thread_.request_signal(audio_signal);
+            });
+        }
+    }
+
+    // The source only copies into the ring, so a slow demux can't hold the
+    // device buffer.  About a second of audio gives the drain thread room to
+    // fall behind.
+    const auto ring_size = static_cast<size_t>(source.SamplesPerSecond()) * source.FrameSize();
+
+    capture_ring_ = std::make_unique<CaptureRing>(ring_size, source.FrameSize(), [this](const uint8_t* p, size_t s)
+    {
+        if (s <= 0)
+            return;
+
+        float_demux_->add(p, s);
+    },
+    [this](uint64_t missing_frames)
+    {
+        float_demux_->mark_discontinuity(missing_frames);
     });
+
+    source.SetDiscontinuityCallback(capture_ring_->discontinuity_writer());
+
+    return source.Start(capture_ring_->writer());
+}
+
+void MainWorker::DrainAudio()
+{
+    main_thread_.verify_on_thread();
+
+    if (!float_demux_)
+        return;
+
+    float_demux_->acknowledge_ready();
+
+    std::array<float_pool_type::unique_ptr_type, 16> blocks;
+
+    for (;;)
+    {
+        const auto count = float_demux_->queue().pop_n(blocks.data(), blocks.size());
+
+        if (0 == count)
+            break;
+
+        // Analysis goes here.  Silent blocks have precomputed results; their
+        // planes aren't written.  A gap in the sequence numbers is a block
+        // lost to overflow; gap_frames says how much audio is missing before
+        // a block, wherever along the way it was lost.
+        for (size_t i = 0; i < count; ++i)
+        {
+            if (blocks[i]->discontinuity)
+            {
+                ++stream_discontinuities_;
+                stream_gap_frames_ += blocks[i]->gap_frames;
+            }
+        }
+
+        if (recorder_)
+        {
+            for (size_t i = 0; i < count; ++i)
+                recorder_->add(*blocks[i]);
+        }
+
+        float_pool_->release_n(blocks.data(), count);
+    }
 }
 
 void MainWorker::Stop()
 {
+    main_thread_.enqueue_work([this]()
+    {
+        if (!float_pool_)
+            return;
+
+        const auto stats = float_pool_->stats();
+
+        printf("float pool: %d in use, %d high water, %d capacity, %" PRIu64 " allocations, %" PRIu64 " failures\n",
+            stats.in_use, stats.high_water, stats.capacity, stats.allocations, stats.failures);
+
+        if (float_demux_)
+        {
+            printf("float demux: %zu frame blocks, %" PRIu64 " blocks dropped on overflow, %" PRIu64 " frames dropped in all\n",
+                float_demux_->block_frames(), float_demux_->overflows(), float_demux_->dropped_frames());
+        }
+
+        if (audio_capture_)
+        {
+            const auto capture = audio_capture_->GetStats();
+
+            printf("capture: %" PRIu64 " packets, %" PRIu64 " frames, %" PRIu64 " discontinuities (%" PRIu64 " frames missing), %" PRIu64 " overruns (%lld us), %lld us worst callback\n",
+                capture.packets, capture.frames, capture.discontinuities, capture.missing_frames, capture.overruns,
+                static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(capture.overrun_time).count()),
+                static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(capture.worst_callback).count()));
+        }
+
+        printf("stream: %" PRIu64 " discontinuities, %" PRIu64 " frames known missing\n", stream_discontinuities_, stream_gap_frames_);
+
+        if (capture_ring_)
+        {
+            const auto ring = capture_ring_->stats();
+
+            printf("capture ring: %zu/%zu bytes, %zu high water, %" PRIu64 " packets, %" PRIu64 " dropped (%" PRIu64 " bytes), %lld us worst write\n",
+                ring.fill, ring.capacity, ring.high_water, ring.packets, ring.dropped_packets, ring.dropped_bytes,
+                static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(ring.worst_write).count()));
+        }
+
+        printf("float pool hold times (us):");
+
+        for (auto i = 0; i < float_pool_type::hold_time_buckets; ++i)
+        {
+            if (stats.hold_time_us[i])
+                printf(" %llu+:%" PRIu64, 1ull << i, stats.hold_time_us[i]);
+        }
+
+        printf("\n");
+    });
+}
+
+void MainWorker::StartRecording(const std::string& path)
+{
+    main_thread_.enqueue_work([this, path]()
+    {
+        if (!float_demux_ || 0 == sample_rate_)
+        {
+            printf("Not capturing; nothing to record\n");
+            return;
+        }
+
+        CloseRecording();
+
+        WavRecorder::Config config;
+
+        // A minute's worth of disk up front.
+        config.preallocate = uint64_t{ 60 } * sample_rate_ * float_demux_->channels() * sizeof(float);
+
+        try
+        {
+            recorder_ = std::make_unique<WavRecorder>(path, float_demux_->channels(), sample_rate_, config);
+        }
+        catch (const std::exception& ex)
+        {
+            printf("Unable to record: %s\n", ex.what());
+        }
+    });
+}
+
+void MainWorker::StopRecording()
+{
+    main_thread_.enqueue_work([this]()
+    {
+        CloseRecording();
+    });
+}
+
+void MainWorker::CloseRecording()
+{
+    main_thread_.verify_on_thread();
+
+    if (!recorder_)
+        return;
+
+    try
+    {
+        recorder_->close();
+    }
+    catch (const std::exception& ex)
+    {
+        printf("%s\n", ex.what());
+    }
+
+    const auto stats = recorder_->stats();
+
+    printf("recording: %" PRIu64 " frames, %" PRIu64 " dropped, %" PRIu64 " bytes written, %d writes in flight at most\n",
+        stats.frames, stats.dropped_frames, stats.bytes_written, stats.in_flight_high_water);
+
+    recorder_.reset();
 }
@@ -4,16 +4,22 @@
 #include "YetAnotherThreadPool.h"
 #include "WindowsQueueWorkItemThreadPool.h"
 
+class CaptureRing;
+class CaptureSource;
+class WavRecorder;
 class CWASAPICapture;
 
 template<class T, int Align>
 class BufferPool;
 
-template<typename T, size_t Size, int Align>
+template<class T, int Align>
+class SizeClassPool;
+
+template<typename T, int Align>
 struct alignas(Align)
-    AudioBuffer;
+    AudioBlock;
 
-template<typename T, size_t Size, int Align>
+template<typename T, int Align>
 class AudioDemux;
 
 class MainWorker
@@ -24,6 +30,11 @@ public:
 
     void Start();
     void Stop();
+
+    // Archive what's captured from here on; a path of an existing file is
+    // overwritten.
+    void StartRecording(const std::string& path);
+    void StopRecording();
 private:
     HandlerThread<> main_thread_;
     WindowsQueueWorkItemThreadPool background_pool_;
@@ -31,10 +42,27 @@ private:
     Microsoft::WRL::ComPtr<CWASAPICapture> audio_capture_;
     bool audio_started_ = false;
 
-    std::shared_ptr<BufferPool<AudioBuffer<float, 4096, 32>, 32>> float_pool_;
-    std::shared_ptr<BufferPool<AudioBuffer<uint16_t, 4096, 32>, 32>> short_pool_;
+    typedef AudioBlock<float, 32> float_block_type;
+    typedef BufferPool<float_block_type, 32> float_pool_type;
+
+    std::unique_ptr<SizeClassPool<float_block_type, 32>> float_pools_;
+    // The class float_demux_ takes its blocks from.
+    std::shared_ptr<float_pool_type> float_pool_;
+    int refill_signal_ = -1;
+
+    std::unique_ptr<AudioDemux<float, 32>> float_demux_;
+    int audio_signal_ = -1;
+
+    std::unique_ptr<CaptureRing> capture_ring_;
+    // Seen on the blocks as they're drained.
+    uint64_t stream_discontinuities_ = 0;
+    uint64_t stream_gap_frames_ = 0;
+    uint32_t sample_rate_ = 0;
 
-    std::unique_ptr<AudioDemux<float, 4096, 32>> float_demux_;
+    std::unique_ptr<WavRecorder> recorder_;
 
     void Init();
+    bool StartCapture(CaptureSource& source);
+    void DrainAudio();
+    void CloseRecording();
 };
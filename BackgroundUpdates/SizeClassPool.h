@@ -0,0 +1,142 @@
+﻿#pragma once
+
+#include "BufferPool.h"
+
+// BufferPools of one buffer type in power-of-two payload sizes, for when the
+// size a buffer needs is only known at run time.  A class is made the first
+// time it's asked for, so memory follows the sizes actually in use instead of
+// the largest one possible.  Every class gets the same Config but for its
+// payload_size.
+template<class T, int Align>
+class SizeClassPool final
+{
+public:
+    typedef BufferPool<T, Align> pool_type;
+
+    // Classes run from min_payload to max_payload bytes, both rounded up to a
+    // power of two.  config.payload_size is ignored.
+    SizeClassPool(const typename pool_type::Config& config, size_t min_payload, size_t max_payload);
+    SizeClassPool() = delete;
+    SizeClassPool(const SizeClassPool&) = delete;
+
+    // The payload of the smallest class that holds size bytes, or 0 if none
+    // does.
+    size_t class_size(size_t size) const noexcept;
+
+    // The pool for size's class, made on first use.  Throws
+    // std::invalid_argument if size is past the largest class.  Not for use on
+    // the real-time thread.
+    std::shared_ptr<pool_type> pool_for(size_t size);
+
+    // Passed on to every class, including those made later.
+    void set_refill_handler(std::function<void()> handler);
+    // Runs maintain() on every class made so far.
+    void maintain();
+    size_t class_count() const;
+private:
+    const typename pool_type::Config config_;
+    size_t min_payload_;
+    size_t max_payload_;
+
+    mutable std::mutex lock_;
+    std::function<void()> refill_handler_;
+    // One per class, smallest first; null until it's asked for.
+    std::vector<std::shared_ptr<pool_type>> pools_;
+};
+
+template<class T, int Align>
+SizeClassPool<T, Align>::SizeClassPool(const typename pool_type::Config& config, const size_t min_payload,
+                                       const size_t max_payload)
+    : config_(config), min_payload_{ 1 }
+{
+    while (min_payload_ < min_payload)
+        min_payload_ *= 2;
+
+    max_payload_ = min_payload_;
+
+    while (max_payload_ < max_payload)
+        max_payload_ *= 2;
+
+    for (auto size = min_payload_; size <= max_payload_; size *= 2)
+        pools_.emplace_back();
+}
+
+template<class T, int Align>
+size_t SizeClassPool<T, Align>::class_size(const size_t size) const noexcept
+{
+    if (size > max_payload_)
+        return 0;
+
+    auto class_size = min_payload_;
+
+    while (class_size < size)
+        class_size *= 2;
+
+    return class_size;
+}
+
+template<class T, int Align>
+std::shared_ptr<typename SizeClassPool<T, Align>::pool_type> SizeClassPool<T, Align>::pool_for(const size_t size)
+{
+    const auto payload_size = class_size(size);
+
+    if (0 == payload_size)
+        throw std::invalid_argument("Larger than the largest size class");
+
+    size_t index = 0;
+
+    for (auto class_size = min_payload_; class_size < payload_size; class_size *= 2)
+        ++index;
+
+    std::lock_guard<std::mutex> lock{ lock_ };
+
+    auto& pool = pools_[index];
+
+    if (!pool)
+    {
+        auto config = config_;
+
+        config.payload_size = payload_size;
+
+        pool = std::make_shared<pool_type>(config);
+
+        if (refill_handler_)
+            pool->set_refill_handler(refill_handler_);
+    }
+
+    return pool;
+}
+
+template<class T, int Align>
+void SizeClassPool<T, Align>::set_refill_handler(std::function<void()> handler)
+{
+    std::lock_guard<std::mutex> lock{ lock_ };
+
+    refill_handler_ = std::move(handler);
+
+    for (auto& pool : pools_)
+    {
+        if (pool)
+            pool->set_refill_handler(refill_handler_);
+    }
+}
+
+template<class T, int Align>
+void SizeClassPool<T, Align>::maintain()
+{
+    std::lock_guard<std::mutex> lock{ lock_ };
+
+    for (auto& pool : pools_)
+    {
+        if (pool)
+            pool->maintain();
+    }
+}
+
+template<class T, int Align>
+size_t SizeClassPool<T, Align>::class_count() const
+{
+    std::lock_guard<std::mutex> lock{ lock_ };
+
+    return std::count_if(pools_.begin(), pools_.end(), [](const std::shared_ptr<pool_type>& pool) { return !!pool; });
+}
@@ -0,0 +1,130 @@
+﻿#pragma once
+
+// A bounded ring for exactly one producer thread and one consumer thread.
+// Neither side ever blocks, locks or allocates, and every call finishes in a
+// fixed number of steps.  Each index is written by one side only and sits on
+// its own cache line next to that side's cached copy of the other index, so
+// the shared line is only read when the ring looks full (or empty).
+template<typename T>
+class SpscQueue final
+{
+public:
+    // capacity is rounded up to a power of two.
+    explicit SpscQueue(size_t capacity);
+    SpscQueue() = delete;
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    //
+    // Producer
+    //
+
+    // On a full ring the value is left alone and false is returned.
+    bool try_push(T&& value);
+    // Room for at least this many pushes.  Only the consumer can change it,
+    // and only upward.
+    size_t free_space() noexcept;
+
+    //
+    // Consumer
+    //
+
+    bool try_pop(T& value);
+    // Moves up to count values into values[0..n) and returns n.
+    size_t pop_n(T* values, size_t count);
+
+    // Either side may call these; the answer may be stale by the time it is
+    // used.
+    size_t size() const noexcept;
+    size_t capacity() const noexcept { return mask_ + 1; }
+private:
+    const size_t mask_;
+    const std::unique_ptr<T[]> items_;
+
+    alignas(64) std::atomic<size_t> tail_{ 0 };
+    size_t cached_head_ = 0;
+
+    alignas(64) std::atomic<size_t> head_{ 0 };
+    size_t cached_tail_ = 0;
+
+    static size_t round_up(size_t capacity) noexcept
+    {
+        size_t size = 1;
+
+        while (size < capacity)
+            size *= 2;
+
+        return size;
+    }
+};
+
+template<typename T>
+SpscQueue<T>::SpscQueue(const size_t capacity)
+    : mask_{ round_up(std::max(capacity, size_t{ 1 })) - 1 },
+      items_{ std::make_unique<T[]>(mask_ + 1) }
+{ }
+
+template<typename T>
+bool SpscQueue<T>::try_push(T&& value)
+{
+    const auto tail = tail_.load(std::memory_order_relaxed);
+
+    if (tail - cached_head_ > mask_)
+    {
+        cached_head_ = head_.load(std::memory_order_acquire);
+
+        if (tail - cached_head_ > mask_)
+            return false;
+    }
+
+    items_[tail & mask_] = std::move(value);
+
+    tail_.store(tail + 1, std::memory_order_release);
+
+    return true;
+}
+
+template<typename T>
+size_t SpscQueue<T>::free_space() noexcept
+{
+    const auto tail = tail_.load(std::memory_order_relaxed);
+
+    if (tail - cached_head_ > mask_)
+        cached_head_ = head_.load(std::memory_order_acquire);
+
+    return capacity() - (tail - cached_head_);
+}
+
+template<typename T>
+bool SpscQueue<T>::try_pop(T& value)
+{
+    return 1 == pop_n(&value, 1);
+}
+
+template<typename T>
+size_t SpscQueue<T>::pop_n(T* values, const size_t count)
+{
+    const auto head = head_.load(std::memory_order_relaxed);
+
+    if (cached_tail_ - head < count)
+        cached_tail_ = tail_.load(std::memory_order_acquire);
+
+    const auto n = std::min(count, cached_tail_ - head);
+
+    for (size_t i = 0; i < n; ++i)
+        values[i] = std::move(items_[(head + i) & mask_]);
+
+    // One release for the whole batch.
+    head_.store(head + n, std::memory_order_release);
+
+    return n;
+}
+
+template<typename T>
+size_t SpscQueue<T>::size() const noexcept
+{
+    const auto head = head_.load(std::memory_order_acquire);
+    const auto tail = tail_.load(std::memory_order_acquire);
+
+    return tail - head;
+}
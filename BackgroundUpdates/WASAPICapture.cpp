@@ -8,6 +8,8 @@
 #include "StdAfx.h"
 #include <assert.h>
 #include <avrt.h>
+#include <mmreg.h>
+#include <ksmedia.h>
 #include "WASAPICapture.h"
 #include "CoInitializeHandle.h"
 
@@ -55,6 +57,19 @@ bool CWASAPICapture::InitializeAudioEngine()
         return false;
     }
 
+    //
+    //  Packets come once per device period.
+    //
+    REFERENCE_TIME devicePeriod;
+    hr = _AudioClient->GetDevicePeriod(&devicePeriod, nullptr);
+    if (FAILED(hr))
+    {
+        printf("Unable to get device period: %x.\n", hr);
+        return false;
+    }
+
+    _PeriodFrames = static_cast<UINT32>(static_cast<UINT64>(devicePeriod) * _MixFormat->nSamplesPerSec / reference_time::period::den);
+
     hr = _AudioClient->SetEventHandle(_AudioSamplesReadyEvent);
     if (FAILED(hr))
     {
@@ -86,6 +101,24 @@ bool CWASAPICapture::LoadFormat()
         return false;
     }
 
+    auto formatTag = _MixFormat->wFormatTag;
+
+    if (WAVE_FORMAT_EXTENSIBLE == formatTag && _MixFormat->cbSize >= 22)
+    {
+        const auto extensible = reinterpret_cast<const WAVEFORMATEXTENSIBLE*>(_MixFormat);
+
+        if (IsEqualGUID(extensible->SubFormat, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT))
+            formatTag = WAVE_FORMAT_IEEE_FLOAT;
+        else if (IsEqualGUID(extensible->SubFormat, KSDATAFORMAT_SUBTYPE_PCM))
+            formatTag = WAVE_FORMAT_PCM;
+    }
+
+    if (!wave_sample_format(formatTag, _MixFormat->wBitsPerSample, _SampleFormat))
+    {
+        printf("Unsupported capture format: tag %x, %d bits\n", _MixFormat->wFormatTag, _MixFormat->wBitsPerSample);
+        return false;
+    }
+
     _FrameSize = (_MixFormat->wBitsPerSample / 8) * _MixFormat->nChannels;
     return true;
 }
@@ -223,7 +256,7 @@ void CWASAPICapture::Shutdown()
 //
 //  Start capturing...
 //
-bool CWASAPICapture::Start(std::function<void(const uint8_t *, size_t)> read_callback)
+bool CWASAPICapture::Start(read_callback_type read_callback)
 {
     read_callback_ = read_callback;
 
@@ -283,7 +316,7 @@ void CWASAPICapture::Stop()
 //  Capture thread - processes samples from the audio engine
 //
 
-void CWASAPICapture::read_buffer() const
+void CWASAPICapture::read_buffer()
 {
     //
     //  We need to retrieve the next buffer of samples from the audio capturer.
@@ -291,15 +324,36 @@ void CWASAPICapture::read_buffer() const
     BYTE* pData;
     UINT32 framesAvailable;
     DWORD flags;
+    UINT64 position;
 
     //
     //  Find out how much capture data is available.  We need to make sure we don't run over the length
     //  of our capture buffer.  We'll discard any samples that don't fit in the buffer.
     //
-    auto hr = _CaptureClient->GetBuffer(&pData, &framesAvailable, &flags, nullptr, nullptr);
+    auto hr = _CaptureClient->GetBuffer(&pData, &framesAvailable, &flags, &position, nullptr);
     if (FAILED(hr))
         return;
 
+    const auto held_from = std::chrono::steady_clock::now();
+
+    //
+    //  The engine flags a glitch itself, but frames it lost also show up as a jump in the device
+    //  position.  The very first packet tends to carry the flag without anything being lost.
+    //
+    const auto positionGood = 0 == (flags & AUDCLNT_BUFFERFLAGS_TIMESTAMP_ERROR);
+
+    if (framesAvailable)
+    {
+        const auto missing = positionGood && _PositionValid && position > _NextPosition ? position - _NextPosition : 0;
+
+        if (!_FirstPacket && (missing > 0 || (flags & AUDCLNT_BUFFERFLAGS_DATA_DISCONTINUITY)))
+            ReportDiscontinuity(missing);
+
+        _NextPosition = position + framesAvailable;
+        _PositionValid = positionGood;
+        _FirstPacket = false;
+    }
+
     if (nullptr != read_callback_ && framesAvailable)
     {
         if (flags & AUDCLNT_BUFFERFLAGS_SILENT)
@@ -313,6 +367,10 @@ void CWASAPICapture::read_buffer() const
     {
         printf("Unable to release capture buffer: %x!\n", hr);
     }
+
+    // An empty GetBuffer() isn't a packet.
+    if (framesAvailable)
+        CountPacket(framesAvailable, std::chrono::steady_clock::now() - held_from);
 }
 
 void CWASAPICapture::read_audio()
@@ -623,6 +681,13 @@ bool CWASAPICapture::HandleStreamSwitchEvent()
         return false;
     }
 
+    //
+    //  The new endpoint counts its position from zero, and whatever was in flight on the old one is gone.
+    //
+    _PositionValid = false;
+    _FirstPacket = true;
+    ReportDiscontinuity(0);
+
     return true;
 }
 
@@ -10,9 +10,11 @@
 #include <AudioClient.h>
 #include <AudioPolicy.h>
 
+#include "CaptureSource.h"
+
 //
 //  WASAPI Capture class.
-class CWASAPICapture : public IAudioSessionEvents, IMMNotificationClient
+class CWASAPICapture : public CaptureSource, public IAudioSessionEvents, IMMNotificationClient
 {
 public:
     typedef std::chrono::duration<REFERENCE_TIME, std::ratio<1, 10000000>> reference_time;
@@ -21,14 +23,15 @@ public:
     CWASAPICapture(const Microsoft::WRL::ComPtr<IMMDevice>& Endpoint, bool EnableStreamSwitch, ERole EndpointRole);
     bool Initialize(reference_time EngineLatency);
     void Shutdown();
-    bool Start(std::function<void(const uint8_t *, size_t)> read_callback);
-    void Stop();
-    void read_buffer() const;
+    bool Start(read_callback_type read_callback) override;
+    void Stop() override;
+    void read_buffer();
     void read_audio();
-    WORD ChannelCount() const noexcept { return _MixFormat->nChannels; }
-    UINT32 SamplesPerSecond() const noexcept { return _MixFormat->nSamplesPerSec; }
+    int ChannelCount() const noexcept override { return _MixFormat->nChannels; }
+    uint32_t SamplesPerSecond() const noexcept override { return _MixFormat->nSamplesPerSec; }
+    SampleFormat Format() const noexcept override { return _SampleFormat; }
+    uint32_t PeriodFrames() const noexcept override { return _PeriodFrames; }
     UINT32 BytesPerSample() const noexcept { return _MixFormat->wBitsPerSample / 8; }
-    size_t FrameSize() const noexcept { return _FrameSize; }
     WAVEFORMATEX* MixFormat() const noexcept { return _MixFormat; }
     STDMETHOD_(ULONG, AddRef)() override;
     STDMETHOD_(ULONG, Release)() override;
@@ -50,13 +53,19 @@ private:
     HANDLE _AudioSamplesReadyEvent = nullptr;
 
     WAVEFORMATEX* _MixFormat = nullptr;
+    SampleFormat _SampleFormat = SampleFormat::float32;
     size_t _FrameSize = 0;
     UINT32 _BufferSize = 0;
+    UINT32 _PeriodFrames = 0;
 
     //
     //  Capture buffer management.
     //
-    std::function<void(const uint8_t *, size_t)> read_callback_;
+    read_callback_type read_callback_;
+    // Device position, in frames, the next packet should start at.
+    UINT64 _NextPosition = 0;
+    bool _PositionValid = false;
+    bool _FirstPacket = true;
 
     void DoCaptureThread();
     //
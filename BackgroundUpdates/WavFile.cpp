@@ -0,0 +1,296 @@
+﻿#include "stdafx.h"
+
+#include <cstring>
+#include <limits>
+
+#include "WavFile.h"
+
+#if !_WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    template<typename T>
+    T read_le(const uint8_t* p) noexcept
+    {
+        T value = 0;
+
+        for (size_t i = 0; i < sizeof(T); ++i)
+            value |= static_cast<T>(p[i]) << (8 * i);
+
+        return value;
+    }
+
+    size_t page_size()
+    {
+#if _WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+
+        return info.dwPageSize;
+#else
+        return static_cast<size_t>(sysconf(_SC_PAGESIZE));
+#endif
+    }
+
+    // Wave64 names its chunks with GUIDs.  Those for "wave", "fmt " and
+    // "data" are the FourCC followed by this; "riff" has its own.
+    const uint8_t w64_suffix[12] = { 0xf3, 0xac, 0xd3, 0x11, 0x8c, 0xd1, 0x00, 0xc0, 0x4f, 0x8e, 0xdb, 0x8a };
+    const uint8_t w64_riff[16] = { 'r', 'i', 'f', 'f', 0x2e, 0x91, 0xcf, 0x11, 0xa5, 0xd6, 0x28, 0xdb, 0x04, 0xc1, 0x00, 0x00 };
+
+    bool is_w64_id(const uint8_t* id, const char* fourcc) noexcept
+    {
+        return 0 == memcmp(id, fourcc, 4) && 0 == memcmp(id + 4, w64_suffix, sizeof(w64_suffix));
+    }
+}
+
+WavFile::WavFile(const std::string& path)
+{
+    map(path);
+
+    try
+    {
+        parse(path);
+    }
+    catch (...)
+    {
+        unmap();
+        throw;
+    }
+}
+
+WavFile::~WavFile()
+{
+    unmap();
+}
+
+void WavFile::parse(const std::string& path)
+{
+    const auto p = view_;
+    const auto size = view_size_;
+
+    // Plain RIFF has eight byte chunk headers (FourCC, 32-bit size of the
+    // body) padded to two bytes.  Wave64 has GUIDs and 64-bit sizes that
+    // count the 24 byte header, padded to eight.
+    auto wave64 = false;
+    auto rf64 = false;
+
+    if (size >= 12 && 0 == memcmp(p, "RIFF", 4) && 0 == memcmp(p + 8, "WAVE", 4))
+    { }
+    else if (size >= 12 && (0 == memcmp(p, "RF64", 4) || 0 == memcmp(p, "BW64", 4)) && 0 == memcmp(p + 8, "WAVE", 4))
+        rf64 = true;
+    else if (size >= 40 && 0 == memcmp(p, w64_riff, sizeof(w64_riff)) && is_w64_id(p + 24, "wave"))
+        wave64 = true;
+    else
+        throw std::runtime_error("WavFile: " + path + " is not a WAV, RF64 or Wave64 file");
+
+    const size_t header_size = wave64 ? 24 : 8;
+    const size_t alignment = wave64 ? 8 : 2;
+
+    auto have_format = false;
+    auto have_data = false;
+    uint16_t format_tag = 0;
+    uint16_t block_align = 0;
+    uint16_t bits_per_sample = 0;
+    // From RF64's ds64 chunk, which stands in for any 32-bit size of ~0.
+    uint64_t ds64_data_size = 0;
+
+    for (size_t offset = wave64 ? 40 : 12; offset + header_size <= size && !have_data;)
+    {
+        const auto id = p + offset;
+        const auto body = offset + header_size;
+
+        uint64_t chunk_size;
+
+        if (wave64)
+        {
+            chunk_size = read_le<uint64_t>(id + 16);
+
+            if (chunk_size < header_size)
+                break;
+
+            chunk_size -= header_size;
+        }
+        else
+        {
+            chunk_size = read_le<uint32_t>(id + 4);
+
+            if (rf64 && 0 == memcmp(id, "data", 4) && 0xffffffff == chunk_size && 0 != ds64_data_size)
+                chunk_size = ds64_data_size;
+        }
+
+        const auto available = static_cast<size_t>(std::min<uint64_t>(chunk_size, size - body));
+
+        const auto is = [wave64, id](const char* fourcc)
+        {
+            return wave64 ? is_w64_id(id, fourcc) : 0 == memcmp(id, fourcc, 4);
+        };
+
+        if (rf64 && is("ds64") && available >= 24)
+        {
+            ds64_data_size = read_le<uint64_t>(p + body + 8);
+        }
+        else if (is("fmt ") && available >= 16)
+        {
+            format_tag = read_le<uint16_t>(p + body);
+            channels_ = read_le<uint16_t>(p + body + 2);
+            sample_rate_ = read_le<uint32_t>(p + body + 4);
+            block_align = read_le<uint16_t>(p + body + 12);
+            bits_per_sample = read_le<uint16_t>(p + body + 14);
+
+            // WAVE_FORMAT_EXTENSIBLE; the subformat GUID starts with the tag.
+            if (0xfffe == format_tag && available >= 40)
+                format_tag = read_le<uint16_t>(p + body + 24);
+
+            have_format = true;
+        }
+        else if (is("data"))
+        {
+            data_ = p + body;
+            size_ = available;
+            have_data = true;
+        }
+
+        if (chunk_size > size - body)
+            break;
+
+        offset = body + static_cast<size_t>((chunk_size + alignment - 1) / alignment * alignment);
+    }
+
+    if (!have_format || !have_data)
+        throw std::runtime_error("WavFile: " + path + " has no fmt or data chunk");
+
+    if (!wave_sample_format(format_tag, bits_per_sample, format_) || channels_ < 1 || 0 == sample_rate_
+        || block_align != frame_size())
+    {
+        throw std::runtime_error("WavFile: " + path + " has an unsupported format");
+    }
+
+    size_ -= size_ % block_align;
+}
+
+#if _WIN32
+
+void WavFile::map(const std::string& path)
+{
+    const auto length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, nullptr, 0);
+    std::wstring wide(length > 0 ? length : 1, L'\0');
+
+    if (length <= 0 || !MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide[0], length))
+        throw std::runtime_error("WavFile: bad path " + path);
+
+    file_ = CreateFileW(wide.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                        FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+
+    if (INVALID_HANDLE_VALUE == file_)
+        throw std::runtime_error("WavFile: unable to open " + path);
+
+    LARGE_INTEGER file_size;
+
+    // An empty file can't be mapped; parse() rejects anything this short.
+    if (!GetFileSizeEx(file_, &file_size) || file_size.QuadPart < 12
+        || static_cast<uint64_t>(file_size.QuadPart) > std::numeric_limits<size_t>::max())
+    {
+        unmap();
+        throw std::runtime_error("WavFile: unable to map " + path);
+    }
+
+    mapping_ = CreateFileMappingW(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+
+    if (mapping_)
+        view_ = static_cast<const uint8_t*>(MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0));
+
+    if (!view_)
+    {
+        unmap();
+        throw std::runtime_error("WavFile: unable to map " + path);
+    }
+
+    view_size_ = static_cast<size_t>(file_size.QuadPart);
+}
+
+void WavFile::unmap() noexcept
+{
+    if (view_)
+        UnmapViewOfFile(view_);
+
+    if (mapping_)
+        CloseHandle(mapping_);
+
+    if (INVALID_HANDLE_VALUE != file_)
+        CloseHandle(file_);
+
+    view_ = nullptr;
+    mapping_ = nullptr;
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+#else // _WIN32
+
+void WavFile::map(const std::string& path)
+{
+    const auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        throw std::runtime_error("WavFile: unable to open " + path);
+
+    struct stat status;
+
+    if (0 == fstat(fd, &status) && status.st_size >= 12)
+    {
+        const auto mapped = mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fd, 0);
+
+        if (MAP_FAILED != mapped)
+        {
+            view_ = static_cast<const uint8_t*>(mapped);
+            view_size_ = static_cast<size_t>(status.st_size);
+        }
+    }
+
+    // The mapping holds its own reference to the file.
+    close(fd);
+
+    if (!view_)
+        throw std::runtime_error("WavFile: unable to map " + path);
+
+    // Larger readahead, and pages behind the reader are dropped first.
+    madvise(const_cast<uint8_t*>(view_), view_size_, MADV_SEQUENTIAL);
+}
+
+void WavFile::unmap() noexcept
+{
+    if (view_)
+        munmap(const_cast<uint8_t*>(view_), view_size_);
+
+    view_ = nullptr;
+}
+
+#endif // _WIN32
+
+void WavFile::prefetch(const size_t offset, const size_t size) const noexcept
+{
+    if (offset >= size_)
+        return;
+
+    static const auto page = page_size();
+
+    // Whole pages, clipped to the mapping.
+    const auto begin = data_ + offset;
+    const auto first = view_ + (begin - view_) / page * page;
+    const auto end = std::min(begin + std::min(size, size_ - offset), view_ + view_size_);
+
+#if _WIN32
+    WIN32_MEMORY_RANGE_ENTRY range;
+
+    range.VirtualAddress = const_cast<uint8_t*>(first);
+    range.NumberOfBytes = end - first;
+
+    PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+#else
+    madvise(const_cast<uint8_t*>(first), end - first, MADV_WILLNEED);
+#endif
+}
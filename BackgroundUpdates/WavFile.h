@@ -0,0 +1,53 @@
+﻿#pragma once
+
+#include "CaptureSource.h"
+
+// A WAV file mapped read-only into memory.  Plain RIFF/WAVE, RF64 (and BW64)
+// with its 64-bit ds64 sizes, and Sony Wave64 are understood, so recordings
+// past 4 GiB work.  The samples are used in place: data() points into the
+// mapping and can go straight to AudioDemux::add() without a copy.
+//
+// The mapping is advised for sequential access.  A reader that wants to
+// stay ahead of the page faults calls prefetch() on the window in front of
+// it; that only starts the I/O and returns.
+class WavFile final
+{
+public:
+    // Throws std::runtime_error if the file can't be mapped or isn't a WAV the
+    // demuxer can convert from.
+    explicit WavFile(const std::string& path);
+    WavFile(const WavFile&) = delete;
+    WavFile& operator=(const WavFile&) = delete;
+    ~WavFile();
+
+    int channels() const noexcept { return channels_; }
+    uint32_t sample_rate() const noexcept { return sample_rate_; }
+    SampleFormat format() const noexcept { return format_; }
+    size_t frame_size() const noexcept { return sample_size(format_) * channels_; }
+
+    // The sample data, trimmed to whole frames.  A truncated recording ends
+    // where the file does.
+    const uint8_t* data() const noexcept { return data_; }
+    size_t size() const noexcept { return size_; }
+    size_t frames() const noexcept { return size_ / frame_size(); }
+
+    // Start reading [offset, offset + size) of the sample data from disk.
+    void prefetch(size_t offset, size_t size) const noexcept;
+private:
+#if _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+    HANDLE mapping_ = nullptr;
+#endif
+    const uint8_t* view_ = nullptr;
+    size_t view_size_ = 0;
+
+    int channels_ = 0;
+    uint32_t sample_rate_ = 0;
+    SampleFormat format_ = SampleFormat::int16;
+    const uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+
+    void map(const std::string& path);
+    void unmap() noexcept;
+    void parse(const std::string& path);
+};
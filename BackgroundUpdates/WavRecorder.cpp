@@ -0,0 +1,618 @@
+﻿#include "stdafx.h"
+
+#include <cstring>
+
+#include "WavRecorder.h"
+
+#if !_WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace
+{
+    template<typename T>
+    void write_le(uint8_t* p, T value) noexcept
+    {
+        for (size_t i = 0; i < sizeof(T); ++i)
+        {
+            p[i] = static_cast<uint8_t>(value);
+            value = static_cast<T>(value >> 8);
+        }
+    }
+
+    // KSDATAFORMAT_SUBTYPE_IEEE_FLOAT
+    const uint8_t ieee_float_guid[16] = { 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00, 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 };
+
+    const size_t chunk_granularity = 64 * 1024;
+}
+
+const size_t WavRecorder::data_offset;
+const size_t WavRecorder::tile_frames;
+
+struct WavRecorder::Chunk
+{
+    uint8_t* data = nullptr;
+    bool pending = false;
+#if _WIN32
+    OVERLAPPED overlapped;
+    HANDLE event = nullptr;
+#else
+    size_t size = 0;
+    uint64_t offset = 0;
+    // Set by the writer thread: bytes written, or -1.
+    std::atomic<int64_t> result{ 0 };
+    std::atomic<bool> done{ false };
+#endif
+};
+
+WavRecorder::WavRecorder(const std::string& path, const int channels, const uint32_t sample_rate, const Config& config)
+    : path_{ path },
+      channels_{ channels },
+      sample_rate_{ sample_rate },
+      frame_size_{ channels * sizeof(float) },
+      // A whole tile always fits in one chunk.
+      chunk_size_{ (std::max(config.chunk_size, tile_frames * frame_size_) + chunk_granularity - 1)
+          / chunk_granularity * chunk_granularity }
+{
+    // The fmt chunk's block alignment is 16 bits.
+    if (channels < 1 || frame_size_ > 0xffff || 0 == sample_rate)
+        throw std::invalid_argument("WavRecorder: unsupported format for " + path);
+
+    planes_.resize(channels_);
+    tile_.resize(tile_frames * channels_);
+
+    chunk_count_ = std::max(config.in_flight, 2);
+    chunks_ = std::make_unique<Chunk[]>(chunk_count_);
+
+    allocate();
+
+    try
+    {
+        create(config);
+    }
+    catch (...)
+    {
+        release();
+        throw;
+    }
+
+    current_ = 0;
+    open_ = true;
+}
+
+WavRecorder::~WavRecorder()
+{
+    try
+    {
+        close();
+    }
+    catch (...)
+    { }
+
+    release();
+}
+
+void WavRecorder::add(const float* const* planes, const size_t length)
+{
+    if (!open_)
+        return;
+
+    for (size_t done = 0; done < length;)
+    {
+        const auto count = std::min(tile_frames, length - done);
+        const auto size = count * frame_size_;
+
+        // All the chunks are still on their way to the disk.
+        if (!reserve(size))
+        {
+            dropped_frames_ += count;
+            done += count;
+
+            continue;
+        }
+
+        // Strided stores, but the tile stays in cache.
+        for (auto c = 0; c < channels_; ++c)
+        {
+            const auto plane = planes[c];
+            auto out = tile_.data() + c;
+
+            if (plane)
+            {
+                for (size_t i = 0; i < count; ++i, out += channels_)
+                    *out = plane[done + i];
+            }
+            else
+            {
+                for (size_t i = 0; i < count; ++i, out += channels_)
+                    *out = 0;
+            }
+        }
+
+        append(reinterpret_cast<const uint8_t*>(tile_.data()), size);
+
+        done += count;
+    }
+}
+
+bool WavRecorder::reserve(const size_t size)
+{
+    if (current_ < 0)
+    {
+        current_ = find_free_chunk();
+        fill_ = 0;
+
+        if (current_ < 0)
+            return false;
+    }
+
+    if (chunk_size_ - fill_ >= size)
+        return true;
+
+    // The rest spills into the next chunk, so there has to be one.
+    return find_free_chunk() >= 0;
+}
+
+void WavRecorder::append(const uint8_t* data, size_t size)
+{
+    while (size > 0)
+    {
+        const auto count = std::min(size, chunk_size_ - fill_);
+
+        memcpy(chunks_[current_].data + fill_, data, count);
+
+        fill_ += count;
+        data += count;
+        size -= count;
+        data_size_ += count;
+
+        if (fill_ == chunk_size_)
+        {
+            submit(current_, chunk_size_, next_offset_);
+
+            next_offset_ += chunk_size_;
+            current_ = -1;
+            current_ = find_free_chunk();
+            fill_ = 0;
+        }
+    }
+}
+
+int WavRecorder::find_free_chunk()
+{
+    for (auto i = 0; i < chunk_count_; ++i)
+    {
+        if (i != current_ && complete(i, false))
+            return i;
+    }
+
+    return -1;
+}
+
+int WavRecorder::in_flight() const noexcept
+{
+    auto count = 0;
+
+    for (auto i = 0; i < chunk_count_; ++i)
+    {
+        if (chunks_[i].pending)
+            ++count;
+    }
+
+    return count;
+}
+
+void WavRecorder::close()
+{
+    if (!open_)
+        return;
+
+    open_ = false;
+
+    // Unbuffered writes are whole sectors; the end of the file is trimmed
+    // back afterwards.
+    if (current_ >= 0 && fill_ > 0)
+    {
+        const auto size = (fill_ + data_offset - 1) / data_offset * data_offset;
+
+        memset(chunks_[current_].data + fill_, 0, size - fill_);
+
+        submit(current_, size, next_offset_);
+    }
+
+    current_ = -1;
+
+    for (auto i = 0; i < chunk_count_; ++i)
+        complete(i, true);
+
+    write_header();
+    truncate(data_offset + data_size_);
+    close_file();
+
+    if (write_errors_ > 0)
+        throw std::runtime_error("WavRecorder: " + std::to_string(write_errors_) + " writes to " + path_ + " failed");
+}
+
+void WavRecorder::write_header()
+{
+    const auto p = chunks_[0].data;
+
+    memset(p, 0, data_offset);
+
+    const auto riff_size = data_offset - 8 + data_size_;
+    const auto rf64 = riff_size > 0xffffffff;
+
+    // The ds64 chunk is always reserved, as JUNK, so a recording can turn
+    // into RF64 without moving the samples.
+    memcpy(p, rf64 ? "RF64" : "RIFF", 4);
+    write_le<uint32_t>(p + 4, rf64 ? 0xffffffff : static_cast<uint32_t>(riff_size));
+    memcpy(p + 8, "WAVE", 4);
+
+    memcpy(p + 12, rf64 ? "ds64" : "JUNK", 4);
+    write_le<uint32_t>(p + 16, 28);
+
+    if (rf64)
+    {
+        write_le<uint64_t>(p + 20, riff_size);
+        write_le<uint64_t>(p + 28, data_size_);
+        write_le<uint64_t>(p + 36, data_size_ / frame_size_);
+    }
+
+    // WAVE_FORMAT_EXTENSIBLE, no speaker positions.
+    memcpy(p + 48, "fmt ", 4);
+    write_le<uint32_t>(p + 52, 40);
+    write_le<uint16_t>(p + 56, 0xfffe);
+    write_le<uint16_t>(p + 58, static_cast<uint16_t>(channels_));
+    write_le<uint32_t>(p + 60, sample_rate_);
+    write_le<uint32_t>(p + 64, static_cast<uint32_t>(sample_rate_ * frame_size_));
+    write_le<uint16_t>(p + 68, static_cast<uint16_t>(frame_size_));
+    write_le<uint16_t>(p + 70, 32);
+    write_le<uint16_t>(p + 72, 22);
+    write_le<uint16_t>(p + 74, 32);
+    memcpy(p + 80, ieee_float_guid, sizeof(ieee_float_guid));
+
+    // Pad out to the samples.
+    memcpy(p + 96, "JUNK", 4);
+    write_le<uint32_t>(p + 100, static_cast<uint32_t>(data_offset - 104 - 8));
+
+    memcpy(p + data_offset - 8, "data", 4);
+    write_le<uint32_t>(p + data_offset - 4, rf64 ? 0xffffffff : static_cast<uint32_t>(data_size_));
+
+    submit(0, data_offset, 0);
+    complete(0, true);
+}
+
+WavRecorder::Stats WavRecorder::stats() const noexcept
+{
+    Stats stats;
+
+    stats.frames = data_size_ / frame_size_;
+    stats.dropped_frames = dropped_frames_;
+    stats.bytes_written = bytes_written_;
+    stats.write_errors = write_errors_;
+    stats.in_flight_high_water = in_flight_high_water_;
+
+    return stats;
+}
+
+#if _WIN32
+
+void WavRecorder::allocate()
+{
+    memory_size_ = chunk_count_ * chunk_size_;
+    memory_ = static_cast<uint8_t*>(VirtualAlloc(nullptr, memory_size_, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+
+    if (!memory_)
+        throw std::bad_alloc();
+
+    for (auto i = 0; i < chunk_count_; ++i)
+        chunks_[i].data = memory_ + i * chunk_size_;
+}
+
+void WavRecorder::release() noexcept
+{
+    if (memory_)
+        VirtualFree(memory_, 0, MEM_RELEASE);
+
+    memory_ = nullptr;
+}
+
+void WavRecorder::create(const Config& config)
+{
+    const auto length = MultiByteToWideChar(CP_UTF8, 0, path_.c_str(), -1, nullptr, 0);
+    std::wstring wide(length > 0 ? length : 1, L'\0');
+
+    if (length <= 0 || !MultiByteToWideChar(CP_UTF8, 0, path_.c_str(), -1, &wide[0], length))
+        throw std::runtime_error("WavRecorder: bad path " + path_);
+
+    const DWORD flags = FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED;
+
+    if (config.unbuffered)
+        file_ = CreateFileW(wide.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, flags | FILE_FLAG_NO_BUFFERING, nullptr);
+
+    if (INVALID_HANDLE_VALUE == file_)
+        file_ = CreateFileW(wide.c_str(), GENERIC_WRITE, FILE_SHARE_READ, nullptr, CREATE_ALWAYS, flags, nullptr);
+
+    if (INVALID_HANDLE_VALUE == file_)
+        throw std::runtime_error("WavRecorder: unable to create " + path_);
+
+    for (auto i = 0; i < chunk_count_; ++i)
+    {
+        chunks_[i].event = CreateEventW(nullptr, TRUE, FALSE, nullptr);
+
+        if (!chunks_[i].event)
+        {
+            close_file();
+            throw std::runtime_error("WavRecorder: unable to create an event for " + path_);
+        }
+    }
+
+    // Only reserves the clusters; the file's size is still what's written.
+    if (config.preallocate > 0)
+    {
+        FILE_ALLOCATION_INFO allocation;
+
+        allocation.AllocationSize.QuadPart = static_cast<LONGLONG>(config.preallocate);
+
+        if (!SetFileInformationByHandle(file_, FileAllocationInfo, &allocation, sizeof(allocation)))
+            printf("WavRecorder: unable to preallocate %s: %x\n", path_.c_str(), GetLastError());
+    }
+}
+
+void WavRecorder::submit(const int chunk, const size_t size, const uint64_t offset)
+{
+    auto& c = chunks_[chunk];
+
+    memset(&c.overlapped, 0, sizeof(c.overlapped));
+
+    c.overlapped.Offset = static_cast<DWORD>(offset);
+    c.overlapped.OffsetHigh = static_cast<DWORD>(offset >> 32);
+    c.overlapped.hEvent = c.event;
+
+    if (!WriteFile(file_, c.data, static_cast<DWORD>(size), nullptr, &c.overlapped) && ERROR_IO_PENDING != GetLastError())
+    {
+        ++write_errors_;
+        return;
+    }
+
+    c.pending = true;
+
+    in_flight_high_water_ = std::max(in_flight_high_water_, in_flight());
+}
+
+bool WavRecorder::complete(const int chunk, const bool wait)
+{
+    auto& c = chunks_[chunk];
+
+    if (!c.pending)
+        return true;
+
+    if (!wait && !HasOverlappedIoCompleted(&c.overlapped))
+        return false;
+
+    DWORD written;
+
+    if (GetOverlappedResult(file_, &c.overlapped, &written, wait ? TRUE : FALSE))
+        bytes_written_ += written;
+    else if (ERROR_IO_INCOMPLETE == GetLastError())
+        return false;
+    else
+        ++write_errors_;
+
+    c.pending = false;
+
+    return true;
+}
+
+void WavRecorder::truncate(const uint64_t size)
+{
+    FILE_END_OF_FILE_INFO end;
+
+    end.EndOfFile.QuadPart = static_cast<LONGLONG>(size);
+
+    if (!SetFileInformationByHandle(file_, FileEndOfFileInfo, &end, sizeof(end)))
+        ++write_errors_;
+}
+
+void WavRecorder::close_file() noexcept
+{
+    for (auto i = 0; i < chunk_count_; ++i)
+    {
+        if (chunks_[i].event)
+            CloseHandle(chunks_[i].event);
+
+        chunks_[i].event = nullptr;
+    }
+
+    if (INVALID_HANDLE_VALUE != file_)
+        CloseHandle(file_);
+
+    file_ = INVALID_HANDLE_VALUE;
+}
+
+#else // _WIN32
+
+void WavRecorder::allocate()
+{
+    memory_size_ = chunk_count_ * chunk_size_;
+
+    const auto mapped = mmap(nullptr, memory_size_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (MAP_FAILED == mapped)
+        throw std::bad_alloc();
+
+    memory_ = static_cast<uint8_t*>(mapped);
+
+    for (auto i = 0; i < chunk_count_; ++i)
+        chunks_[i].data = memory_ + i * chunk_size_;
+}
+
+void WavRecorder::release() noexcept
+{
+    if (memory_)
+        munmap(memory_, memory_size_);
+
+    memory_ = nullptr;
+}
+
+void WavRecorder::create(const Config& config)
+{
+    const auto flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+#ifdef O_DIRECT
+    if (config.unbuffered)
+        file_ = open(path_.c_str(), flags | O_DIRECT, 0644);
+#endif
+
+    if (file_ < 0)
+        file_ = open(path_.c_str(), flags, 0644);
+
+    if (file_ < 0)
+        throw std::runtime_error("WavRecorder: unable to create " + path_);
+
+#ifdef FALLOC_FL_KEEP_SIZE
+    // Only reserves the blocks; the file's size is still what's written.
+    if (config.preallocate > 0 && 0 != fallocate(file_, FALLOC_FL_KEEP_SIZE, 0, static_cast<off_t>(config.preallocate)))
+        printf("WavRecorder: unable to preallocate %s: %d\n", path_.c_str(), errno);
+#endif
+
+    writer_ = std::thread{ &WavRecorder::write_thread, this };
+}
+
+void WavRecorder::write_thread()
+{
+    for (;;)
+    {
+        int chunk;
+
+        {
+            std::unique_lock<std::mutex> lock{ write_lock_ };
+
+            write_cv_.wait(lock, [this]() { return write_stop_ || !write_queue_.empty(); });
+
+            if (write_queue_.empty())
+                return;
+
+            chunk = write_queue_.front();
+            write_queue_.erase(write_queue_.begin());
+        }
+
+        auto& c = chunks_[chunk];
+
+        int64_t written = 0;
+
+        while (static_cast<size_t>(written) < c.size)
+        {
+            const auto count = pwrite(file_, c.data + written, c.size - written, static_cast<off_t>(c.offset + written));
+
+            if (count > 0)
+            {
+                written += count;
+                continue;
+            }
+
+#ifdef O_DIRECT
+            // Some file systems take O_DIRECT at open() and refuse it here.
+            if (count < 0 && EINVAL == errno && (fcntl(file_, F_GETFL) & O_DIRECT))
+            {
+                fcntl(file_, F_SETFL, fcntl(file_, F_GETFL) & ~O_DIRECT);
+                continue;
+            }
+#endif
+
+            if (count < 0 && EINTR == errno)
+                continue;
+
+            written = -1;
+            break;
+        }
+
+        {
+            std::lock_guard<std::mutex> lock{ write_lock_ };
+
+            c.result.store(written, std::memory_order_relaxed);
+            c.done.store(true, std::memory_order_release);
+        }
+
+        done_cv_.notify_all();
+    }
+}
+
+void WavRecorder::submit(const int chunk, const size_t size, const uint64_t offset)
+{
+    auto& c = chunks_[chunk];
+
+    c.size = size;
+    c.offset = offset;
+    c.done.store(false, std::memory_order_relaxed);
+    c.pending = true;
+
+    {
+        std::lock_guard<std::mutex> lock{ write_lock_ };
+
+        write_queue_.push_back(chunk);
+    }
+
+    write_cv_.notify_one();
+
+    in_flight_high_water_ = std::max(in_flight_high_water_, in_flight());
+}
+
+bool WavRecorder::complete(const int chunk, const bool wait)
+{
+    auto& c = chunks_[chunk];
+
+    if (!c.pending)
+        return true;
+
+    if (wait)
+    {
+        std::unique_lock<std::mutex> lock{ write_lock_ };
+
+        done_cv_.wait(lock, [&c]() { return c.done.load(std::memory_order_acquire); });
+    }
+    else if (!c.done.load(std::memory_order_acquire))
+        return false;
+
+    const auto written = c.result.load(std::memory_order_relaxed);
+
+    if (written < 0)
+        ++write_errors_;
+    else
+        bytes_written_ += static_cast<uint64_t>(written);
+
+    c.pending = false;
+
+    return true;
+}
+
+void WavRecorder::truncate(const uint64_t size)
+{
+    if (0 != ftruncate(file_, static_cast<off_t>(size)))
+        ++write_errors_;
+}
+
+void WavRecorder::close_file() noexcept
+{
+    if (writer_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock{ write_lock_ };
+
+            write_stop_ = true;
+        }
+
+        write_cv_.notify_all();
+        writer_.join();
+    }
+
+    if (file_ >= 0)
+        ::close(file_);
+
+    file_ = -1;
+}
+
+#endif // _WIN32
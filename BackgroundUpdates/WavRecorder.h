@@ -0,0 +1,138 @@
+﻿#pragma once
+
+#include <string>
+
+// Records planar float audio to a WAV file, switching to RF64 past 4 GiB,
+// without making the caller wait on the disk.  add() interleaves into one of
+// a few large, sector-aligned chunks; a full chunk is written asynchronously
+// while the next one fills.  At most in_flight writes are outstanding.  If
+// they are all still busy when a chunk is needed, add() drops the audio and
+// counts it instead of blocking.
+//
+// On Windows the writes are overlapped and, by default, unbuffered.  Elsewhere
+// one writer thread does them with pwrite() and O_DIRECT.  The header is
+// written last, by close(), and the space for the file can be reserved up front
+// so it isn't extended a chunk at a time.
+class WavRecorder final
+{
+public:
+    struct Config
+    {
+        // Bytes per write.  Rounded up to a multiple of 64 KiB.
+        size_t chunk_size = 4 * 1024 * 1024;
+        // The number of chunks, and so the most writes outstanding at once.
+        // At least 2, so one chunk can fill while another is written.
+        int in_flight = 4;
+        // Bypass the file cache.  Quietly falls back to buffered writes where
+        // the file system won't do it.
+        bool unbuffered = true;
+        // Bytes of disk to reserve when the file is created; 0 for none.
+        uint64_t preallocate = 0;
+    };
+
+    struct Stats
+    {
+        uint64_t frames;
+        uint64_t dropped_frames;
+        uint64_t bytes_written;
+        uint64_t write_errors;
+        int in_flight_high_water;
+    };
+
+    // Throws std::runtime_error if the file can't be created.
+    WavRecorder(const std::string& path, int channels, uint32_t sample_rate, const Config& config);
+    WavRecorder(const std::string& path, const int channels, const uint32_t sample_rate)
+        : WavRecorder(path, channels, sample_rate, Config{})
+    { }
+    WavRecorder(const WavRecorder&) = delete;
+    WavRecorder& operator=(const WavRecorder&) = delete;
+    // Closes the file if close() hasn't, ignoring any error.
+    ~WavRecorder();
+
+    int channels() const noexcept { return channels_; }
+    uint32_t sample_rate() const noexcept { return sample_rate_; }
+
+    // Appends length frames.  planes holds channels() pointers; a null one is
+    // silence.  Only one thread may add.
+    void add(const float* const* planes, size_t length);
+
+    // An AudioBlock with at least channels() planes.
+    template<typename Block>
+    void add(const Block& block)
+    {
+        for (auto c = 0; c < channels_; ++c)
+            planes_[c] = block.silent ? nullptr : block.plane(c);
+
+        add(planes_.data(), block.length);
+    }
+
+    // Writes what's left, waits for every write and fills in the header.
+    // Throws std::runtime_error if anything failed to reach the file.
+    void close();
+
+    // From the thread that adds.
+    Stats stats() const noexcept;
+private:
+    // The header takes the first sector-aligned block, so the samples start
+    // aligned too.
+    static const size_t data_offset = 4096;
+    static const size_t tile_frames = 256;
+
+    struct Chunk;
+
+    const std::string path_;
+    const int channels_;
+    const uint32_t sample_rate_;
+    const size_t frame_size_;
+    const size_t chunk_size_;
+
+    std::vector<const float*> planes_;
+    std::vector<float> tile_;
+    std::unique_ptr<Chunk[]> chunks_;
+    int chunk_count_ = 0;
+    uint8_t* memory_ = nullptr;
+    size_t memory_size_ = 0;
+
+    // The chunk being filled, or -1 if none was free.
+    int current_ = -1;
+    size_t fill_ = 0;
+    uint64_t next_offset_ = data_offset;
+    uint64_t data_size_ = 0;
+    bool open_ = false;
+
+    uint64_t dropped_frames_ = 0;
+    uint64_t bytes_written_ = 0;
+    uint64_t write_errors_ = 0;
+    int in_flight_high_water_ = 0;
+
+#if _WIN32
+    HANDLE file_ = INVALID_HANDLE_VALUE;
+#else
+    int file_ = -1;
+
+    std::mutex write_lock_;
+    std::condition_variable write_cv_;
+    std::condition_variable done_cv_;
+    std::vector<int> write_queue_;
+    bool write_stop_ = false;
+    std::thread writer_;
+
+    void write_thread();
+#endif
+
+    bool reserve(size_t size);
+    void append(const uint8_t* data, size_t size);
+    int find_free_chunk();
+    void submit(int chunk, size_t size, uint64_t offset);
+    // Collects a finished write; with wait, blocks until it is.  Returns
+    // whether the chunk is free.
+    bool complete(int chunk, bool wait);
+    int in_flight() const noexcept;
+    void write_header();
+
+    void allocate();
+    void release() noexcept;
+    void create(const Config& config);
+    void truncate(uint64_t size);
+    void close_file() noexcept;
+};
@@ -0,0 +1,132 @@
+﻿#include "stdafx.h"
+
+#include "WavReplay.h"
+
+WavReplay::WavReplay(const std::string& path, const Config& config)
+    : config_(config), file_(path)
+{
+    if (!(config_.speed >= 0))
+        throw std::invalid_argument("WavReplay: speed must not be negative");
+}
+
+WavReplay::~WavReplay()
+{
+    Stop();
+}
+
+bool WavReplay::Start(read_callback_type read_callback)
+{
+    if (thread_.joinable())
+        return false;
+
+    read_callback_ = std::move(read_callback);
+
+    stop_requested_.store(false, std::memory_order_relaxed);
+    finished_.store(false, std::memory_order_relaxed);
+
+    thread_ = std::thread{ &WavReplay::run, this };
+
+    return true;
+}
+
+void WavReplay::Stop()
+{
+    {
+        std::lock_guard<std::mutex> lock{ stop_lock_ };
+
+        stop_requested_.store(true, std::memory_order_relaxed);
+    }
+
+    stop_cv_.notify_all();
+
+    if (thread_.joinable())
+        thread_.join();
+
+    read_callback_ = nullptr;
+}
+
+void WavReplay::run()
+{
+    using clock = std::chrono::steady_clock;
+
+    const auto frame_size = FrameSize();
+    const auto frames = file_.frames();
+    const auto sample_rate = file_.sample_rate();
+    const auto period = PeriodFrames();
+    const auto paced = config_.speed > 0;
+    const auto rate = paced ? sample_rate * config_.speed : 0.0;
+    const auto late_after = paced ? std::chrono::duration<double>(period / rate) : std::chrono::duration<double>{};
+    const auto data = file_.data();
+
+    // Everything before prefetched has been asked for.
+    size_t prefetched = 0;
+
+    const auto start = clock::now();
+    uint64_t sent = 0;
+    size_t position = 0;
+    // The end of the file doesn't run on into its start.
+    auto restarted = false;
+
+    for (;;)
+    {
+        if (position == frames)
+        {
+            if (!config_.loop || 0 == frames)
+                break;
+
+            position = 0;
+            prefetched = 0;
+            restarted = true;
+        }
+
+        // Keep between one and two windows in flight ahead of the packet.
+        if (position * frame_size + prefetch_window >= prefetched)
+        {
+            const auto from = std::max(prefetched, position * frame_size);
+
+            file_.prefetch(from, 2 * prefetch_window - (from - position * frame_size));
+
+            prefetched = position * frame_size + 2 * prefetch_window;
+        }
+
+        const auto count = std::min<size_t>(period, frames - position);
+
+        if (paced)
+        {
+            // A device hands over a packet once its last frame is in.
+            const auto due = start + std::chrono::duration_cast<clock::duration>(
+                std::chrono::duration<double>((sent + count) / rate));
+
+            std::unique_lock<std::mutex> lock{ stop_lock_ };
+
+            if (stop_cv_.wait_until(lock, due, [this]() { return stop_requested_.load(std::memory_order_relaxed); }))
+                return;
+
+            lock.unlock();
+
+            if (clock::now() - due > late_after)
+                late_packets_.fetch_add(1, std::memory_order_relaxed);
+        }
+        else if (stop_requested_.load(std::memory_order_relaxed))
+            return;
+
+        if (restarted)
+        {
+            ReportDiscontinuity(0);
+            restarted = false;
+        }
+
+        const auto held_from = clock::now();
+
+        read_callback_(data + position * frame_size, count * frame_size);
+
+        CountPacket(count, clock::now() - held_from);
+
+        position += count;
+        sent += count;
+
+        frames_delivered_.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    finished_.store(true, std::memory_order_release);
+}
@@ -0,0 +1,69 @@
+﻿#pragma once
+
+#include "CaptureSource.h"
+#include "WavFile.h"
+
+// Plays a WAV file into a read callback from its own thread, standing in for
+// a capture device.  Packets are period_frames long and paced against the
+// steady clock: at speed 1 each one arrives when a device would have finished
+// capturing it, at speed N that many times sooner, and at speed 0 as soon as
+// the callback returns.
+//
+// Packets point straight into the mapped file (see WavFile).  The replay
+// thread prefetches a window ahead of itself, so at real-time pace the disk
+// keeps up without faults on the callback path; unthrottled, the disk may set
+// the pace on the first pass over a file that isn't cached.
+class WavReplay final : public CaptureSource
+{
+public:
+    struct Config
+    {
+        double speed = 1.0;
+        // Zero picks 10 ms worth.
+        uint32_t period_frames = 0;
+        // Start over at the end instead of finishing.
+        bool loop = false;
+    };
+
+    // Throws std::runtime_error if the file can't be mapped or isn't a WAV the
+    // demuxer can convert from.
+    WavReplay(const std::string& path, const Config& config);
+    ~WavReplay();
+
+    // False if a replay is already running.  Stop() it (even once it has
+    // finished) before starting again from the top.
+    bool Start(read_callback_type read_callback) override;
+    void Stop() override;
+
+    int ChannelCount() const noexcept override { return file_.channels(); }
+    uint32_t SamplesPerSecond() const noexcept override { return file_.sample_rate(); }
+    SampleFormat Format() const noexcept override { return file_.format(); }
+    uint32_t PeriodFrames() const noexcept override
+    {
+        return 0 != config_.period_frames ? config_.period_frames : std::max(file_.sample_rate() / 100, 1u);
+    }
+
+    // True once a replay that doesn't loop has delivered its last packet.
+    bool Finished() const noexcept { return finished_.load(std::memory_order_acquire); }
+    uint64_t FramesDelivered() const noexcept { return frames_delivered_.load(std::memory_order_relaxed); }
+    // Packets that went out more than a period behind schedule because the
+    // callback, or the machine, couldn't keep up with the requested speed.
+    uint64_t LatePackets() const noexcept { return late_packets_.load(std::memory_order_relaxed); }
+private:
+    static const size_t prefetch_window = 4 * 1024 * 1024;
+
+    const Config config_;
+    const WavFile file_;
+
+    read_callback_type read_callback_;
+    std::thread thread_;
+    std::atomic<bool> stop_requested_{ false };
+    std::mutex stop_lock_;
+    std::condition_variable stop_cv_;
+
+    std::atomic<bool> finished_{ false };
+    std::atomic<uint64_t> frames_delivered_{ 0 };
+    std::atomic<uint64_t> late_packets_{ 0 };
+
+    void run();
+};
@@ -0,0 +1,302 @@
+// Replays a WAV file through the capture path the way MainWorker wires a
+// device: WavReplay stands in for the device, a CaptureRing takes its
+// packets, and the ring's drain thread feeds AudioDemux.  This thread pops
+// and releases the blocks, as MainWorker::DrainAudio() does, and at the end
+// the counters from every stage are printed.
+//
+//     capture_replay [--speed N] [--period frames] [--filter] file.wav
+//     capture_replay --quick
+//
+// --speed 0 replays as fast as the pipeline takes it (the default is 1,
+// real time).  --quick records a short file with WavRecorder, replays it
+// unthrottled and fails unless every frame comes out the other end.
+#include "stdafx.h"
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "AudioDemux.h"
+#include "CaptureRing.h"
+#include "SizeClassPool.h"
+#include "WavRecorder.h"
+#include "WavReplay.h"
+
+namespace
+{
+    typedef AudioDemux<float, 32> demux_type;
+    typedef demux_type::block_type block_type;
+    typedef demux_type::pool_type pool_type;
+
+    struct Options
+    {
+        std::string path;
+        double speed = 1.0;
+        uint32_t period_frames = 0;
+        bool filter = false;
+        // The ring's size in seconds of audio; MainWorker uses one.
+        double ring_seconds = 1.0;
+    };
+
+    struct Result
+    {
+        uint64_t frames_delivered;
+        uint64_t block_frames;
+        uint64_t lost_frames;
+        // Frames in a full block.
+        size_t block_size;
+    };
+
+    Result replay(const Options& options)
+    {
+        WavReplay::Config config;
+
+        config.speed = options.speed;
+        config.period_frames = options.period_frames;
+
+        WavReplay source{ options.path, config };
+
+        const auto channels = source.ChannelCount();
+
+        pool_type::Config pool_config;
+
+        pool_config.buffer_count = 64;
+        pool_config.magazine_size = 2;
+        pool_config.slab = true;
+        pool_config.prefault = true;
+
+        // Blocks about a period long, as MainWorker sizes them.
+        SizeClassPool<block_type, 32> pools{ pool_config, block_type::payload_size(1, 256),
+                                             block_type::payload_size(8, 8192) };
+
+        const auto pool = pools.pool_for(block_type::payload_size(channels, source.PeriodFrames()));
+        const auto demux = demux_type::create(pool, source.Format(), channels, 64);
+
+        if (options.filter)
+        {
+            Preprocessing preprocessing;
+
+            preprocessing.dc_block = true;
+
+            demux->set_preprocessing(preprocessing);
+        }
+
+        std::mutex ready_lock;
+        std::condition_variable ready_cv;
+        auto ready = false;
+
+        demux->set_ready_handler([&]()
+        {
+            {
+                std::lock_guard<std::mutex> lock{ ready_lock };
+
+                ready = true;
+            }
+
+            ready_cv.notify_one();
+        });
+
+        const auto ring_size = static_cast<size_t>(options.ring_seconds * source.SamplesPerSecond() * source.FrameSize());
+
+        auto ring = std::make_unique<CaptureRing>(ring_size, source.FrameSize(),
+            [&demux](const uint8_t* p, const size_t s) { demux->add(p, s); },
+            [&demux](const uint64_t missing_frames) { demux->mark_discontinuity(missing_frames); });
+
+        std::array<pool_type::unique_ptr_type, 16> blocks;
+        uint64_t block_count = 0;
+        uint64_t block_frames = 0;
+        uint64_t discontinuities = 0;
+        uint64_t gap_frames = 0;
+
+        const auto drain = [&]()
+        {
+            demux->acknowledge_ready();
+
+            while (const auto count = demux->queue().pop_n(blocks.data(), blocks.size()))
+            {
+                for (size_t i = 0; i < count; ++i)
+                {
+                    ++block_count;
+                    block_frames += blocks[i]->length;
+
+                    if (blocks[i]->discontinuity)
+                    {
+                        ++discontinuities;
+                        gap_frames += blocks[i]->gap_frames;
+                    }
+                }
+
+                pool->release_n(blocks.data(), count);
+            }
+        };
+
+        source.SetDiscontinuityCallback(ring->discontinuity_writer());
+
+        const auto start = std::chrono::steady_clock::now();
+
+        if (!source.Start(ring->writer()))
+            throw std::runtime_error("capture_replay: the replay didn't start");
+
+        while (!source.Finished())
+        {
+            {
+                std::unique_lock<std::mutex> lock{ ready_lock };
+
+                ready_cv.wait_for(lock, std::chrono::milliseconds{ 10 }, [&ready]() { return ready; });
+
+                ready = false;
+            }
+
+            drain();
+        }
+
+        source.Stop();
+
+        const auto ring_stats = ring->stats();
+
+        // Whatever is still queued goes through the demuxer before the ring
+        // goes away.
+        ring.reset();
+
+        drain();
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto frames = source.FramesDelivered();
+        const auto capture = source.GetStats();
+        const auto pool_stats = pool->stats();
+
+        printf("%s: %d channels, %u Hz, speed %g\n", options.path.c_str(), channels, source.SamplesPerSecond(),
+               options.speed);
+        printf("replay: %" PRIu64 " frames in %.3f s (%.1fx real time), %" PRIu64 " late packets\n", frames, seconds,
+               frames / static_cast<double>(source.SamplesPerSecond()) / seconds, source.LatePackets());
+        printf("capture: %" PRIu64 " packets, %" PRIu64 " discontinuities (%" PRIu64 " frames missing), %" PRIu64
+               " overruns, %lld us worst callback\n", capture.packets, capture.discontinuities,
+               capture.missing_frames, capture.overruns,
+               static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(capture.worst_callback).count()));
+        printf("capture ring: %zu high water of %zu bytes, %" PRIu64 " packets, %" PRIu64 " dropped (%" PRIu64
+               " bytes), %lld us worst write\n", ring_stats.high_water, ring_stats.capacity, ring_stats.packets,
+               ring_stats.dropped_packets, ring_stats.dropped_bytes,
+               static_cast<long long>(std::chrono::duration_cast<std::chrono::microseconds>(ring_stats.worst_write).count()));
+        printf("demux: %" PRIu64 " blocks of %zu, %" PRIu64 " frames, %" PRIu64 " overflows, %" PRIu64
+               " dropped frames\n", block_count, demux->block_frames(), block_frames, demux->overflows(),
+               demux->dropped_frames());
+        printf("stream: %" PRIu64 " discontinuities, %" PRIu64 " frames known missing\n", discontinuities, gap_frames);
+        printf("pool: %d high water of %d, %" PRIu64 " failures\n", pool_stats.high_water, pool_stats.capacity,
+               pool_stats.failures);
+
+        return { frames, block_frames, ring_stats.dropped_bytes / source.FrameSize() + demux->dropped_frames(),
+                 demux->block_frames() };
+    }
+
+    // Two seconds of a sine per channel, each at its own frequency.  The
+    // recorder drops what it can't write in time, so the chunks are made big
+    // enough for the whole file; the frame count written is returned.
+    uint64_t record_test_file(const std::string& path, const int channels, const uint32_t sample_rate)
+    {
+        WavRecorder::Config config;
+
+        config.chunk_size = 4 * sample_rate * channels * sizeof(float);
+        config.unbuffered = false;
+
+        WavRecorder recorder{ path, channels, sample_rate, config };
+
+        const size_t period = 1000;
+        std::vector<float> storage(period * channels);
+        std::vector<const float*> planes(channels);
+
+        for (auto c = 0; c < channels; ++c)
+            planes[c] = &storage[c * period];
+
+        for (size_t start = 0; start < 2 * sample_rate; start += period)
+        {
+            for (auto c = 0; c < channels; ++c)
+            {
+                for (size_t i = 0; i < period; ++i)
+                    storage[c * period + i] = 0.5f * static_cast<float>(sin(2 * 3.14159265358979 * 100 * (c + 1) * (start + i) / sample_rate));
+            }
+
+            recorder.add(planes.data(), period);
+        }
+
+        recorder.close();
+
+        return recorder.stats().frames;
+    }
+
+    int usage(const char* name)
+    {
+        fprintf(stderr, "usage: %s [--speed N] [--period frames] [--filter] file.wav\n"
+                        "       %s --quick\n", name, name);
+
+        return 2;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options options;
+    auto quick = false;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--quick"))
+            quick = true;
+        else if (0 == strcmp(argv[i], "--filter"))
+            options.filter = true;
+        else if (0 == strcmp(argv[i], "--speed") && i + 1 < argc)
+            options.speed = atof(argv[++i]);
+        else if (0 == strcmp(argv[i], "--period") && i + 1 < argc)
+            options.period_frames = static_cast<uint32_t>(atoi(argv[++i]));
+        else if ('-' != argv[i][0] && options.path.empty())
+            options.path = argv[i];
+        else
+            return usage(argv[0]);
+    }
+
+    if (quick == !options.path.empty() || options.speed < 0)
+        return usage(argv[0]);
+
+    try
+    {
+        if (!quick)
+        {
+            replay(options);
+
+            return 0;
+        }
+
+        options.path = "capture_replay_quick.wav";
+        options.speed = 0;
+        options.filter = true;
+        // Room for the whole file, in the ring and in 64 blocks, so nothing is
+        // dropped however the threads get scheduled.
+        options.ring_seconds = 4;
+        options.period_frames = 4096;
+
+        const auto recorded = record_test_file(options.path, 6, 48000);
+
+        const auto result = replay(options);
+
+        remove(options.path.c_str());
+
+        // Only the partly filled last block stays behind in the demuxer.
+        if (result.frames_delivered != recorded || result.lost_frames || result.block_frames > recorded ||
+            result.frames_delivered - result.block_frames >= result.block_size || 0 == result.block_frames)
+        {
+            fprintf(stderr, "capture_replay: %" PRIu64 " frames recorded, %" PRIu64 " replayed, %" PRIu64
+                    " out, %" PRIu64 " lost\n", recorded, result.frames_delivered, result.block_frames,
+                    result.lost_frames);
+
+            return 1;
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,174 @@
+// Deinterleave throughput per channel layout and sample format: the kernel
+// Deinterleave<float>::find() picks on this CPU against a plain loop over
+// frames and channels, the way AudioDemux::add() used to do it.  Both write
+// float planes from the same interleaved input.
+//
+//     deinterleave_bench [--quick]
+//
+// GB/s is interleaved input consumed.
+#include "stdafx.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "Deinterleave.h"
+
+namespace
+{
+    const size_t frames = 4096;
+
+    const char* format_name(const SampleFormat format)
+    {
+        switch (format)
+        {
+        case SampleFormat::int16: return "int16";
+        case SampleFormat::int24: return "int24";
+        case SampleFormat::int32: return "int32";
+        case SampleFormat::float32: return "float32";
+        case SampleFormat::float64: return "float64";
+        }
+
+        return "?";
+    }
+
+    float load(const SampleFormat format, const uint8_t* p)
+    {
+        switch (format)
+        {
+        case SampleFormat::int16:
+        {
+            int16_t v;
+            memcpy(&v, p, sizeof(v));
+            return v * (1.0f / 32768);
+        }
+        case SampleFormat::int24:
+            return static_cast<int32_t>(static_cast<uint32_t>(p[0]) << 8 | static_cast<uint32_t>(p[1]) << 16 |
+                                        static_cast<uint32_t>(p[2]) << 24) * (1.0f / 2147483648.0f);
+        case SampleFormat::int32:
+        {
+            int32_t v;
+            memcpy(&v, p, sizeof(v));
+            return v * (1.0f / 2147483648.0f);
+        }
+        case SampleFormat::float32:
+        {
+            float v;
+            memcpy(&v, p, sizeof(v));
+            return v;
+        }
+        case SampleFormat::float64:
+        {
+            double v;
+            memcpy(&v, p, sizeof(v));
+            return static_cast<float>(v);
+        }
+        }
+
+        return 0.0f;
+    }
+
+    // One sample at a time, converting through a switch.
+    void scalar_loop(const SampleFormat format, const uint8_t* src, const int channels, float* const* planes)
+    {
+        const auto size = sample_size(format);
+
+        for (size_t i = 0; i < frames; ++i)
+        {
+            for (auto c = 0; c < channels; ++c, src += size)
+                planes[c][i] = load(format, src);
+        }
+    }
+
+    template<class Kernel>
+    double gigabytes_per_second(const Kernel& kernel, const size_t input_size,
+                                const std::chrono::steady_clock::duration duration)
+    {
+        kernel();
+
+        const auto start = std::chrono::steady_clock::now();
+
+        size_t calls = 0;
+
+        for (; std::chrono::steady_clock::now() - start < duration; ++calls)
+            kernel();
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        return calls * input_size / seconds / 1e9;
+    }
+
+    void run(const SampleFormat format, const int channels, const std::chrono::steady_clock::duration duration)
+    {
+        const auto input_size = frames * channels * sample_size(format);
+
+        std::vector<uint8_t> input(input_size);
+        std::mt19937 rng{ 1 };
+
+        for (auto& byte : input)
+            byte = static_cast<uint8_t>(rng());
+
+        // Keep float inputs finite.
+        if (SampleFormat::float32 == format)
+        {
+            for (size_t i = 0; i < input_size; i += 4)
+                input[i + 3] &= 0x3f;
+        }
+        else if (SampleFormat::float64 == format)
+        {
+            for (size_t i = 0; i < input_size; i += 8)
+                input[i + 7] &= 0x3f;
+        }
+
+        // Planes on 64 byte boundaries, as AudioBlock lays them out.
+        std::vector<float> storage(frames * channels + 16);
+        std::vector<float*> planes(channels);
+
+        const auto aligned = reinterpret_cast<float*>((reinterpret_cast<uintptr_t>(storage.data()) + 63) & ~uintptr_t{ 63 });
+
+        for (auto c = 0; c < channels; ++c)
+            planes[c] = aligned + c * frames;
+
+        const auto kernel = Deinterleave<float>::find(format, channels);
+
+        const auto simd = gigabytes_per_second([&]() { kernel(input.data(), channels, planes.data(), frames); },
+                                               input_size, duration);
+        const auto scalar = gigabytes_per_second([&]() { scalar_loop(format, input.data(), channels, planes.data()); },
+                                                 input_size, duration);
+
+        printf("%-8s %3d %9.2f %9.2f %7.1fx\n", format_name(format), channels, simd, scalar, simd / scalar);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    auto quick = false;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--quick"))
+            quick = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const SampleFormat formats[] = { SampleFormat::int16, SampleFormat::int24, SampleFormat::int32,
+                                     SampleFormat::float32, SampleFormat::float64 };
+    const int channel_counts[] = { 1, 2, 4, 6, 8, 16, 32 };
+
+    const auto duration = quick ? std::chrono::steady_clock::duration{ std::chrono::milliseconds{ 1 } }
+                                : std::chrono::steady_clock::duration{ std::chrono::milliseconds{ 200 } };
+
+    printf("SIMD level %d, %zu frames per call%s\n", static_cast<int>(simd_level()), frames, quick ? ", quick" : "");
+    printf("%-8s %3s %9s %9s %8s\n", "format", "ch", "GB/s", "loop GB/s", "speedup");
+
+    for (const auto format : formats)
+    {
+        for (const auto channels : channel_counts)
+            run(format, channels, duration);
+    }
+
+    return 0;
+}
@@ -0,0 +1,203 @@
+// Feeds synthetic interleaved packets of device-sized periods through
+// AudioDemux and its BufferPool and reports, for every sample format, channel
+// count and period:
+//
+//     ns/frame     time in add() per interleaved frame
+//     MB/s         interleaved input consumed
+//     allocs/s     pool allocations (one per finished block)
+//
+// The pool and demuxer are set up the way MainWorker::StartCapture() does.
+// Blocks are popped and released as they come, on the same thread, so the
+// release cost is in the numbers too.
+//
+//     demux_bench [--quick] [--filter]
+//
+// --filter turns on DC blocking, as MainWorker does, which takes the fused
+// filter kernels instead of the plain deinterleave.
+#include "stdafx.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "AudioDemux.h"
+
+namespace
+{
+    typedef AudioDemux<float, 32> demux_type;
+    typedef demux_type::pool_type pool_type;
+
+    const char* format_name(const SampleFormat format)
+    {
+        switch (format)
+        {
+        case SampleFormat::int16: return "int16";
+        case SampleFormat::int24: return "int24";
+        case SampleFormat::int32: return "int32";
+        case SampleFormat::float32: return "float32";
+        case SampleFormat::float64: return "float64";
+        }
+
+        return "?";
+    }
+
+    // Noise at about -6 dBFS, so the float kernels see ordinary values.
+    std::vector<uint8_t> make_input(const SampleFormat format, const size_t samples)
+    {
+        std::vector<uint8_t> data(samples * sample_size(format));
+        std::mt19937 rng{ 1 };
+        std::uniform_real_distribution<double> dist{ -0.5, 0.5 };
+
+        for (size_t i = 0; i < samples; ++i)
+        {
+            const auto x = dist(rng);
+            const auto p = &data[i * sample_size(format)];
+
+            switch (format)
+            {
+            case SampleFormat::int16:
+            {
+                const auto v = static_cast<int16_t>(x * 32767);
+                memcpy(p, &v, sizeof(v));
+                break;
+            }
+            case SampleFormat::int24:
+            {
+                const auto v = static_cast<int32_t>(x * 8388607);
+                p[0] = static_cast<uint8_t>(v);
+                p[1] = static_cast<uint8_t>(v >> 8);
+                p[2] = static_cast<uint8_t>(v >> 16);
+                break;
+            }
+            case SampleFormat::int32:
+            {
+                const auto v = static_cast<int32_t>(x * 2147483647.0);
+                memcpy(p, &v, sizeof(v));
+                break;
+            }
+            case SampleFormat::float32:
+            {
+                const auto v = static_cast<float>(x);
+                memcpy(p, &v, sizeof(v));
+                break;
+            }
+            case SampleFormat::float64:
+                memcpy(p, &x, sizeof(x));
+                break;
+            }
+        }
+
+        return data;
+    }
+
+    std::shared_ptr<pool_type> make_pool(const int channels)
+    {
+        pool_type::Config config;
+
+        config.buffer_count = 16;
+        config.magazine_size = 2;
+        config.slab = true;
+        config.prefault = true;
+        config.payload_size = demux_type::block_type::payload_size(channels, 4096);
+
+        return std::make_shared<pool_type>(config);
+    }
+
+    void run(const SampleFormat format, const int channels, const size_t period, const bool filter,
+             const std::chrono::steady_clock::duration duration)
+    {
+        const auto frame_size = sample_size(format) * channels;
+        // Several periods' worth, cycled, so the input isn't always in L1.
+        const auto packets = std::max<size_t>(1, (1u << 20) / (period * frame_size));
+        const auto input = make_input(format, packets * period * channels);
+
+        const auto pool = make_pool(channels);
+        const auto demux = demux_type::create(pool, format, channels);
+
+        if (filter)
+        {
+            Preprocessing preprocessing;
+
+            preprocessing.dc_block = true;
+
+            demux->set_preprocessing(preprocessing);
+        }
+
+        std::array<pool_type::unique_ptr_type, 16> blocks;
+
+        const auto drain = [&]()
+        {
+            while (const auto count = demux->queue().pop_n(blocks.data(), blocks.size()))
+                pool->release_n(blocks.data(), count);
+        };
+
+        // One pass to settle the caches and the pool.
+        for (size_t i = 0; i < packets; ++i)
+        {
+            demux->add(&input[i * period * frame_size], period * frame_size);
+            drain();
+        }
+
+        const auto before = pool->stats();
+        const auto start = std::chrono::steady_clock::now();
+
+        size_t frames = 0;
+
+        for (size_t i = 0; std::chrono::steady_clock::now() - start < duration; ++i, frames += period)
+        {
+            demux->add(&input[(i % packets) * period * frame_size], period * frame_size);
+            drain();
+        }
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const auto after = pool->stats();
+
+        printf("%-8s %3d %5zu %9.3f %10.1f %11.0f %11.0f %6" PRIu64 "\n", format_name(format), channels, period,
+               seconds * 1e9 / frames, frames * frame_size / seconds / 1e6,
+               (after.allocations - before.allocations) / seconds, (after.releases - before.releases) / seconds,
+               after.failures + demux->overflows());
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    auto quick = false;
+    auto filter = false;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--quick"))
+            quick = true;
+        else if (0 == strcmp(argv[i], "--filter"))
+            filter = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick] [--filter]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const SampleFormat formats[] = { SampleFormat::int16, SampleFormat::int24, SampleFormat::int32,
+                                     SampleFormat::float32, SampleFormat::float64 };
+    const int channel_counts[] = { 1, 2, 4, 6, 8, 16, 32 };
+    const size_t periods[] = { 480, 1024, 4096 };
+
+    // --quick just checks that everything runs.
+    const auto duration = quick ? std::chrono::steady_clock::duration{ std::chrono::milliseconds{ 2 } }
+                                : std::chrono::steady_clock::duration{ std::chrono::milliseconds{ 200 } };
+
+    printf("%s, SIMD level %d%s\n", filter ? "DC blocking" : "no filtering", static_cast<int>(simd_level()),
+           quick ? ", quick" : "");
+    printf("%-8s %3s %5s %9s %10s %11s %11s %6s\n", "format", "ch", "frames", "ns/frame", "MB/s", "allocs/s",
+           "releases/s", "lost");
+
+    for (const auto format : formats)
+    {
+        for (const auto channels : channel_counts)
+        {
+            for (const auto period : periods)
+                run(format, channels, period, filter, duration);
+        }
+    }
+
+    return 0;
+}
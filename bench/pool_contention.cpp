@@ -0,0 +1,181 @@
+// Contention on BufferPool's free list against the mutex-guarded stack it
+// replaced, at 1 to 32 threads.  Every thread takes two buffers, touches
+// them and gives them back, as fast as it can.  Thread 0 stands in for the
+// capture thread and times each of its allocations; the worst of those is
+// what a real-time caller would have waited.
+//
+//     pool_contention [--quick]
+//
+// Columns are, per pool: million allocate/release pairs per second over all
+// threads, and thread 0's worst allocate in microseconds.
+#include "stdafx.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include "BufferPool.h"
+
+namespace
+{
+    struct alignas(32) Buffer
+    {
+        uint32_t length;
+        float data[1024];
+
+        void reset() noexcept { length = 0; }
+    };
+
+    // BufferPool as it was: a std::stack behind a std::mutex, with a
+    // std::function deleter.
+    class MutexPool final
+    {
+    public:
+        typedef std::unique_ptr<Buffer, std::function<void(Buffer*)>> unique_ptr_type;
+
+        explicit MutexPool(const int buffer_count)
+        {
+            for (auto i = 0; i < buffer_count; ++i)
+                free_.push(std::make_unique<Buffer>());
+        }
+
+        unique_ptr_type allocate()
+        {
+            std::unique_ptr<Buffer> p;
+
+            {
+                std::lock_guard<std::mutex> lock{ lock_ };
+
+                if (free_.empty())
+                    return { nullptr, [](Buffer*) { } };
+
+                p = std::move(free_.top());
+
+                free_.pop();
+            }
+
+            p->reset();
+
+            return { p.release(), [this](Buffer* b) { release(b); } };
+        }
+    private:
+        std::mutex lock_;
+        std::stack<std::unique_ptr<Buffer>> free_;
+
+        void release(Buffer* p)
+        {
+            std::lock_guard<std::mutex> lock{ lock_ };
+
+            free_.push(std::unique_ptr<Buffer>(p));
+        }
+    };
+
+    struct Result
+    {
+        double pairs_per_second;
+        double worst_us;
+    };
+
+    template<typename Pool>
+    Result run(Pool& pool, const int threads, const std::chrono::steady_clock::duration duration)
+    {
+        std::atomic<bool> go{ false };
+        std::atomic<bool> stop{ false };
+        std::vector<uint64_t> pairs(threads);
+        std::chrono::steady_clock::duration worst{};
+        std::vector<std::thread> workers;
+
+        for (auto t = 0; t < threads; ++t)
+        {
+            workers.emplace_back([&, t]()
+            {
+                while (!go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+
+                uint64_t count = 0;
+
+                while (!stop.load(std::memory_order_relaxed))
+                {
+                    const auto start = 0 == t ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+                    auto a = pool.allocate();
+
+                    if (0 == t)
+                        worst = std::max(worst, std::chrono::steady_clock::now() - start);
+
+                    auto b = pool.allocate();
+
+                    if (a)
+                        a->length = 1;
+                    if (b)
+                        b->length = 2;
+
+                    ++count;
+                }
+
+                pairs[t] = count;
+            });
+        }
+
+        const auto start = std::chrono::steady_clock::now();
+
+        go.store(true, std::memory_order_release);
+
+        std::this_thread::sleep_for(duration);
+
+        stop.store(true, std::memory_order_relaxed);
+
+        for (auto& worker : workers)
+            worker.join();
+
+        const auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        uint64_t total = 0;
+
+        for (const auto count : pairs)
+            total += count;
+
+        return { total / seconds / 1e6, std::chrono::duration<double, std::micro>(worst).count() };
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    auto quick = false;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--quick"))
+            quick = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const auto duration = quick ? std::chrono::steady_clock::duration{ std::chrono::milliseconds{ 5 } }
+                                : std::chrono::steady_clock::duration{ std::chrono::milliseconds{ 500 } };
+
+    printf("%u hardware threads%s\n", std::thread::hardware_concurrency(), quick ? ", quick" : "");
+    printf("%7s %19s %19s %19s\n", "threads", "mutex", "lock-free", "lock-free+magazine");
+
+    for (const auto threads : { 1, 2, 4, 8, 16, 32 })
+    {
+        // Enough that nobody goes without.
+        const auto buffer_count = 2 * threads + 16;
+
+        MutexPool mutex_pool{ buffer_count };
+        BufferPool<Buffer, 32> lock_free_pool{ buffer_count };
+        BufferPool<Buffer, 32> magazine_pool{ buffer_count, 4 };
+
+        const auto mutex = run(mutex_pool, threads, duration);
+        const auto lock_free = run(lock_free_pool, threads, duration);
+        const auto magazine = run(magazine_pool, threads, duration);
+
+        printf("%7d %8.2f M/s %6.1f us %8.2f M/s %6.1f us %8.2f M/s %6.1f us\n", threads,
+               mutex.pairs_per_second, mutex.worst_us, lock_free.pairs_per_second, lock_free.worst_us,
+               magazine.pairs_per_second, magazine.worst_us);
+    }
+
+    return 0;
+}
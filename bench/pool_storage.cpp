@@ -0,0 +1,136 @@
+// Slab storage against one heap allocation per buffer.  For each layout the
+// pool is built, then every buffer is taken, written once per page and given
+// back: first while the pages are cold, then again once they are warm.
+//
+//     pool_storage [--quick]
+//
+// Columns are the construction time, the first cycle (time and minor page
+// faults) and the steady-state cycle, all per buffer.
+#include "stdafx.h"
+
+#include <cstdio>
+#include <cstring>
+
+#include <sys/resource.h>
+
+#include "BufferPool.h"
+
+namespace
+{
+    // The size of an AudioBuffer<float, 4096, 32>.
+    struct alignas(32) Buffer
+    {
+        uint32_t length;
+        float data[4096];
+
+        void reset() noexcept { length = 0; }
+    };
+
+    typedef BufferPool<Buffer, 32> pool_type;
+
+    long minor_faults()
+    {
+        rusage usage{};
+
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_minflt;
+    }
+
+    double cycle(pool_type& pool, std::vector<pool_type::unique_ptr_type>& buffers)
+    {
+        const auto start = std::chrono::steady_clock::now();
+
+        for (auto& buffer : buffers)
+        {
+            buffer = pool.try_allocate();
+
+            auto* p = reinterpret_cast<volatile uint8_t*>(buffer.get());
+
+            for (size_t offset = 0; offset < sizeof(Buffer); offset += 4096)
+                p[offset] = 1;
+        }
+
+        for (auto& buffer : buffers)
+            buffer.reset();
+
+        return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void run(const char* name, const pool_type::Config& config, const int repeat)
+    {
+        const auto count = config.buffer_count;
+        std::vector<pool_type::unique_ptr_type> buffers(count);
+
+        auto construct = 0.0;
+        auto first = 0.0;
+        auto faults = 0.0;
+        auto steady = 0.0;
+
+        for (auto r = 0; r < repeat; ++r)
+        {
+            const auto start = std::chrono::steady_clock::now();
+
+            pool_type pool{ config };
+
+            construct += std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+
+            const auto faults_before = minor_faults();
+
+            first += cycle(pool, buffers);
+
+            faults += minor_faults() - faults_before;
+
+            for (auto i = 0; i < 4; ++i)
+                steady += cycle(pool, buffers) / 4;
+        }
+
+        const auto per_buffer = 1.0 / (repeat * count);
+
+        printf("%-16s %6d %10.0f ns %10.0f ns %8.2f %10.0f ns\n", name, count, construct * per_buffer,
+               first * per_buffer, faults * per_buffer, steady * per_buffer);
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    auto quick = false;
+
+    for (auto i = 1; i < argc; ++i)
+    {
+        if (0 == strcmp(argv[i], "--quick"))
+            quick = true;
+        else
+        {
+            fprintf(stderr, "usage: %s [--quick]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    const auto repeat = quick ? 1 : 20;
+
+    printf("%-16s %6s %13s %13s %8s %13s\n", "storage", "count", "construct", "first cycle", "faults", "steady cycle");
+
+    for (const auto count : { 32, 128, 512 })
+    {
+        pool_type::Config config;
+
+        config.buffer_count = count;
+
+        run("heap", config, repeat);
+
+        config.prefault = true;
+
+        run("heap, prefault", config, repeat);
+
+        config.slab = true;
+
+        run("slab", config, repeat);
+
+        config.huge_pages = true;
+
+        run("slab, huge pages", config, repeat);
+    }
+
+    return 0;
+}
@@ -0,0 +1,128 @@
+// CaptureRing hands every packet downstream whole and in order, with the
+// discontinuities in their places, however the packets fall against the
+// end of the ring.
+#include "stdafx.h"
+
+#include "CaptureRing.h"
+#include "check.h"
+
+namespace
+{
+    struct Event
+    {
+        // 0 for a discontinuity.
+        size_t size;
+        bool silent;
+        uint8_t first;
+        uint64_t missing_frames;
+    };
+
+    void check_packets_stay_whole()
+    {
+        std::mutex lock;
+        std::vector<Event> received;
+        auto corrupt = 0;
+
+        std::vector<Event> sent;
+
+        {
+            CaptureRing ring{ 4096, 4, [&](const uint8_t* p, const size_t size)
+            {
+                // Each packet counts up from its first byte.
+                if (p)
+                {
+                    for (size_t i = 1; i < size; ++i)
+                        corrupt += static_cast<uint8_t>(p[0] + i) != p[i];
+                }
+
+                std::lock_guard<std::mutex> guard{ lock };
+
+                received.push_back({ size, !p, p ? p[0] : uint8_t{ 0 }, 0 });
+            },
+            [&](const uint64_t missing_frames)
+            {
+                std::lock_guard<std::mutex> guard{ lock };
+
+                received.push_back({ 0, false, 0, missing_frames });
+            } };
+
+            const auto write = ring.writer();
+            const auto discontinuity = ring.discontinuity_writer();
+
+            std::mt19937 rng{ 1 };
+            std::vector<uint8_t> packet(1600);
+
+            for (auto n = 0; n < 5000; ++n)
+            {
+                // Leave room for a packet and the padding in front of it, so
+                // nothing is dropped.
+                while (ring.stats().fill > 1024)
+                    std::this_thread::yield();
+
+                if (0 == n % 97)
+                {
+                    discontinuity(n);
+                    sent.push_back({ 0, false, 0, static_cast<uint64_t>(n) });
+
+                    continue;
+                }
+
+                const auto size = 4 * (1 + rng() % 250);
+                const auto silent = 0 == n % 13;
+                const auto first = static_cast<uint8_t>(rng());
+
+                for (size_t i = 0; i < size; ++i)
+                    packet[i] = static_cast<uint8_t>(first + i);
+
+                write(silent ? nullptr : packet.data(), size);
+                sent.push_back({ size, silent, silent ? uint8_t{ 0 } : first, 0 });
+            }
+
+            CHECK(0 == ring.stats().dropped_packets);
+        }
+
+        CHECK(0 == corrupt);
+        CHECK(sent.size() == received.size());
+
+        const auto count = std::min(sent.size(), received.size());
+        auto mismatched = 0;
+
+        for (size_t i = 0; i < count; ++i)
+        {
+            mismatched += sent[i].size != received[i].size || sent[i].silent != received[i].silent ||
+                          sent[i].first != received[i].first || sent[i].missing_frames != received[i].missing_frames;
+        }
+
+        CHECK(0 == mismatched);
+    }
+
+    void check_high_water()
+    {
+        CaptureRing ring{ 1 << 16, 4, [](const uint8_t*, size_t) { }, nullptr };
+
+        const auto write = ring.writer();
+        std::vector<uint8_t> packet(1024);
+
+        for (auto n = 0; n < 1000; ++n)
+        {
+            while (ring.stats().fill)
+                std::this_thread::yield();
+
+            write(packet.data(), packet.size());
+        }
+
+        // One packet at a time, so never more than one record in the ring,
+        // and the padding in front of it where it wrapped.
+        const auto high_water = ring.stats().high_water;
+
+        CHECK(high_water >= 8 + packet.size() && high_water < 2 * (8 + packet.size()));
+    }
+}
+
+int main()
+{
+    check_packets_stay_whole();
+    check_high_water();
+
+    return check_result();
+}
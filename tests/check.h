@@ -0,0 +1,27 @@
+#pragma once
+
+#include <cstdio>
+
+// Just enough to fail a test program: CHECK reports the expression and
+// carries on, and main returns check_result().
+inline int& check_failures() noexcept
+{
+    static int failures;
+
+    return failures;
+}
+
+#define CHECK(condition) \
+    ((condition) ? (void)0 \
+                 : (fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition), \
+                    (void)++check_failures()))
+
+inline int check_result() noexcept
+{
+    if (0 == check_failures())
+        return 0;
+
+    fprintf(stderr, "%d check(s) failed\n", check_failures());
+
+    return 1;
+}
@@ -0,0 +1,92 @@
+// A prefaulted pool, and a demuxer drawing on one, should take no page
+// faults once warm.  Minor faults are read with getrusage around a steady
+// run of capture-sized packets, after one run to warm everything up.
+#include "stdafx.h"
+
+#include <sys/resource.h>
+
+#include "AudioDemux.h"
+#include "check.h"
+
+namespace
+{
+    typedef AudioDemux<float, 32> demux_type;
+    typedef demux_type::pool_type pool_type;
+
+    const int channels = 8;
+    const size_t period = 480;
+
+    long minor_faults()
+    {
+        rusage usage{};
+
+        getrusage(RUSAGE_SELF, &usage);
+
+        return usage.ru_minflt;
+    }
+
+    void check_steady_state(const char* name, const pool_type::Config& config)
+    {
+        const auto pool = std::make_shared<pool_type>(config);
+        const auto demux = demux_type::create(pool, SampleFormat::float32, channels);
+
+        Preprocessing preprocessing;
+
+        preprocessing.dc_block = true;
+
+        demux->set_preprocessing(preprocessing);
+
+        std::vector<float> packet(period * channels, 0.25f);
+        std::array<pool_type::unique_ptr_type, 16> blocks;
+
+        const auto run = [&]()
+        {
+            // Enough to cycle every buffer in the pool several times.
+            for (auto i = 0; i < 1000; ++i)
+            {
+                demux->add(reinterpret_cast<const uint8_t*>(packet.data()), packet.size() * sizeof(float));
+
+                while (const auto count = demux->queue().pop_n(blocks.data(), blocks.size()))
+                    pool->release_n(blocks.data(), count);
+            }
+        };
+
+        run();
+
+        const auto before = minor_faults();
+
+        run();
+
+        const auto faults = minor_faults() - before;
+
+        if (faults)
+            fprintf(stderr, "%s: %ld page faults in the steady state\n", name, faults);
+
+        CHECK(0 == faults);
+        CHECK(pool->resident());
+        CHECK(0 == pool->stats().failures);
+    }
+}
+
+int main()
+{
+    pool_type::Config config;
+
+    config.buffer_count = 16;
+    config.magazine_size = 2;
+    config.prefault = true;
+    config.payload_size = demux_type::block_type::payload_size(channels, 4096);
+
+    check_steady_state("heap", config);
+
+    config.slab = true;
+
+    check_steady_state("slab", config);
+
+    config.huge_pages = true;
+    config.lock_memory = true;
+
+    check_steady_state("slab, huge pages, locked", config);
+
+    return check_result();
+}
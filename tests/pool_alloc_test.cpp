@@ -0,0 +1,129 @@
+// Once a pool is built, handing out and taking back buffers must not go near
+// the heap.  operator new is replaced to count calls, and every way of
+// getting a buffer in and out of the pool is run in a loop between two
+// readings of the count.
+#include "stdafx.h"
+
+#include <cstdlib>
+#include <new>
+
+#include "BufferPool.h"
+#include "check.h"
+
+namespace
+{
+    std::atomic<uint64_t> new_calls{ 0 };
+
+    void* counted_new(const size_t size, const size_t alignment)
+    {
+        new_calls.fetch_add(1, std::memory_order_relaxed);
+
+        void* p = nullptr;
+
+        if (0 != posix_memalign(&p, std::max(alignment, sizeof(void*)), size ? size : 1))
+            throw std::bad_alloc{};
+
+        return p;
+    }
+
+    struct alignas(32) Buffer
+    {
+        uint32_t length;
+        float data[256];
+
+        void reset() noexcept { length = 0; }
+    };
+
+    typedef BufferPool<Buffer, 32> pool_type;
+
+    void cycle(pool_type& pool)
+    {
+        for (auto i = 0; i < 1000; ++i)
+        {
+            auto a = pool.try_allocate();
+            auto b = pool.allocate();
+
+            CHECK(a && b);
+
+            pool.release(std::move(a));
+
+            auto shared = pool_type::share(std::move(b));
+            auto copy = shared;
+
+            shared.reset();
+            copy.reset();
+
+            pool_type::unique_ptr_type batch[8];
+
+            CHECK(pool.allocate_n(batch, 8));
+
+            pool.release_n(batch, 8);
+
+            auto waited = pool.allocate_for(std::chrono::milliseconds{ 1 });
+
+            CHECK(!!waited);
+        }
+    }
+
+    void check_no_heap(const char* name, const pool_type::Config& config)
+    {
+        pool_type pool{ config };
+
+        pool.set_refill_handler([]() { });
+
+        // The first pass from this thread claims its cache.
+        cycle(pool);
+
+        const auto before = new_calls.load();
+
+        cycle(pool);
+
+        const auto calls = new_calls.load() - before;
+
+        if (calls)
+            fprintf(stderr, "%s: %llu calls to operator new\n", name, static_cast<unsigned long long>(calls));
+
+        CHECK(0 == calls);
+    }
+}
+
+void* operator new(const size_t size) { return counted_new(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new[](const size_t size) { return counted_new(size, __STDCPP_DEFAULT_NEW_ALIGNMENT__); }
+void* operator new(const size_t size, const std::align_val_t alignment) { return counted_new(size, static_cast<size_t>(alignment)); }
+void* operator new[](const size_t size, const std::align_val_t alignment) { return counted_new(size, static_cast<size_t>(alignment)); }
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { free(p); }
+void operator delete(void* p, size_t, std::align_val_t) noexcept { free(p); }
+void operator delete[](void* p, size_t, std::align_val_t) noexcept { free(p); }
+
+int main()
+{
+    pool_type::Config config;
+
+    config.buffer_count = 16;
+
+    check_no_heap("heap", config);
+
+    config.slab = true;
+
+    check_no_heap("slab", config);
+
+    config.magazine_size = 4;
+
+    check_no_heap("slab with magazines", config);
+
+    config.slab = false;
+    config.buffer_count = 12;
+    config.max_count = 64;
+    config.grow_chunk = 4;
+    config.low_watermark = 2;
+
+    check_no_heap("growable with magazines", config);
+
+    return check_result();
+}
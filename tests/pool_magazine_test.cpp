@@ -0,0 +1,159 @@
+// A thread's cache holds at most two magazines.  allocate_n() can leave it
+// full, from the rest of a long chain or from putting back a failed batch,
+// and the next release has to make room rather than write past the end
+// into the next thread's cache.
+//
+// Each case runs on a fresh pool type, so this thread has cache 0 and the
+// helper thread cache 1, right behind it.  The helper parks a buffer in its
+// cache; if the release wrote over it, draining the pool turns up that
+// buffer twice and loses another.
+#include "stdafx.h"
+
+#include <set>
+
+#include "BufferPool.h"
+#include "check.h"
+
+namespace
+{
+    template<int Case>
+    struct alignas(32) Buffer
+    {
+        uint32_t length;
+        float data[64];
+
+        void reset() noexcept { length = 0; }
+    };
+
+    template<int Case>
+    using pool_type = BufferPool<Buffer<Case>, 32>;
+
+    // Releases parked from the helper's cache, then takes everything.
+    template<int Case>
+    void check_drain(pool_type<Case>& pool, typename pool_type<Case>::unique_ptr_type parked)
+    {
+        std::thread{ [&parked]() { parked.reset(); } }.join();
+
+        std::vector<typename pool_type<Case>::unique_ptr_type> all;
+        std::set<const void*> distinct;
+
+        while (auto buffer = pool.try_allocate())
+        {
+            distinct.insert(buffer.get());
+            all.push_back(std::move(buffer));
+        }
+
+        CHECK(static_cast<int>(all.size()) == pool.capacity());
+        CHECK(distinct.size() == all.size());
+
+        const auto stats = pool.stats();
+
+        CHECK(stats.in_use == pool.capacity());
+    }
+
+    // allocate_n() fails and puts its partial batch back through the cache.
+    void check_failed_batch()
+    {
+        pool_type<0> pool{ 8, 2 };
+
+        auto held = pool.allocate();
+        auto parked = pool.allocate();
+
+        pool_type<0>::unique_ptr_type batch[8];
+
+        CHECK(!pool.allocate_n(batch, 8));
+
+        held.reset();
+
+        check_drain(pool, std::move(parked));
+    }
+
+    // allocate_n() takes one buffer off a long chain and keeps the rest.
+    void check_long_chain()
+    {
+        pool_type<1> pool{ 16, 2 };
+
+        auto held = pool.allocate();
+        auto parked = pool.allocate();
+
+        pool_type<1>::unique_ptr_type batch[16];
+
+        // Leaves four in the cache and the other ten as one chain.
+        CHECK(!pool.allocate_n(batch, 16));
+
+        pool_type<1>::unique_ptr_type singles[4];
+
+        for (auto& single : singles)
+            single = pool.allocate();
+
+        CHECK(pool.allocate_n(batch, 1));
+
+        held.reset();
+
+        pool.release_n(singles, 4);
+        pool.release_n(batch, 1);
+
+        check_drain(pool, std::move(parked));
+    }
+
+    // Several threads cycling batches and singles through small magazines.
+    void check_stress()
+    {
+        pool_type<2> pool{ 32, 1 };
+
+        std::vector<std::thread> threads;
+
+        for (auto t = 0; t < 4; ++t)
+        {
+            threads.emplace_back([&pool, t]()
+            {
+                std::mt19937 rng{ static_cast<unsigned>(t) };
+                pool_type<2>::unique_ptr_type batch[12];
+
+                for (auto i = 0; i < 20000; ++i)
+                {
+                    const auto count = 1 + rng() % 12;
+
+                    if (pool.allocate_n(batch, count))
+                    {
+                        auto single = pool.try_allocate();
+
+                        pool.release_n(batch, count / 2);
+
+                        for (auto j = count / 2; j < count; ++j)
+                            batch[j].reset();
+                    }
+                }
+            });
+        }
+
+        for (auto& thread : threads)
+            thread.join();
+
+        const auto stats = pool.stats();
+
+        CHECK(0 == stats.in_use);
+        CHECK(stats.allocations == stats.releases);
+
+        std::vector<pool_type<2>::unique_ptr_type> all;
+        std::set<const void*> distinct;
+
+        while (auto buffer = pool.try_allocate())
+        {
+            distinct.insert(buffer.get());
+            all.push_back(std::move(buffer));
+        }
+
+        CHECK(static_cast<int>(all.size()) == pool.capacity());
+        CHECK(distinct.size() == all.size());
+    }
+}
+
+int main()
+{
+    check_failed_batch();
+    check_long_chain();
+    check_stress();
+
+    return check_result();
+}
@@ -0,0 +1,157 @@
+// BufferPool's counters: in use, high water, failures, allocations and
+// releases, and the hold-time histogram, with and without magazines.
+#include "stdafx.h"
+
+#include "BufferPool.h"
+#include "check.h"
+
+namespace
+{
+    struct alignas(32) Buffer
+    {
+        uint32_t length;
+        float data[256];
+
+        void reset() noexcept { length = 0; }
+    };
+
+    typedef BufferPool<Buffer, 32> pool_type;
+
+    uint64_t hold_total(const pool_type::Stats& stats)
+    {
+        return std::accumulate(stats.hold_time_us.begin(), stats.hold_time_us.end(), uint64_t{ 0 });
+    }
+
+    void check_counts(const int magazine_size)
+    {
+        pool_type pool{ 4, magazine_size };
+
+        auto stats = pool.stats();
+
+        CHECK(0 == stats.allocations);
+        CHECK(0 == stats.releases);
+        CHECK(0 == stats.failures);
+        CHECK(0 == stats.in_use);
+        CHECK(0 == stats.high_water);
+        CHECK(4 == stats.capacity);
+        CHECK(0 == hold_total(stats));
+
+        auto a = pool.allocate();
+        auto b = pool.allocate();
+        auto c = pool.try_allocate();
+
+        stats = pool.stats();
+
+        CHECK(3 == stats.allocations);
+        CHECK(3 == stats.in_use);
+        CHECK(3 == stats.high_water);
+
+        a.reset();
+
+        stats = pool.stats();
+
+        CHECK(1 == stats.releases);
+        CHECK(2 == stats.in_use);
+        CHECK(3 == stats.high_water);
+        CHECK(1 == hold_total(stats));
+
+        pool_type::unique_ptr_type more[2];
+
+        CHECK(pool.allocate_n(more, 2));
+        CHECK(!pool.try_allocate());
+        CHECK(!pool.allocate());
+        CHECK(!pool.allocate_n(more, 1));
+
+        stats = pool.stats();
+
+        CHECK(5 == stats.allocations);
+        CHECK(3 == stats.failures);
+        CHECK(4 == stats.in_use);
+        CHECK(4 == stats.high_water);
+
+        pool.release_n(more, 2);
+        b.reset();
+        c.reset();
+
+        stats = pool.stats();
+
+        CHECK(5 == stats.releases);
+        CHECK(0 == stats.in_use);
+        CHECK(4 == stats.high_water);
+        CHECK(5 == hold_total(stats));
+
+        if (magazine_size)
+            CHECK(stats.depot_transfers < stats.allocations + stats.releases);
+        else
+            CHECK(stats.depot_transfers == stats.allocations + stats.releases);
+    }
+
+    void check_hold_time()
+    {
+        pool_type pool{ 4 };
+
+        auto held = pool.allocate();
+
+        std::this_thread::sleep_for(std::chrono::milliseconds{ 5 });
+
+        held.reset();
+
+        const auto stats = pool.stats();
+
+        // 5 ms is at least 4096 us, bucket 12; a slow wakeup can only push it up.
+        auto longest = 0;
+
+        for (auto i = 0; i < pool_type::hold_time_buckets; ++i)
+        {
+            if (stats.hold_time_us[i])
+                longest = i;
+        }
+
+        CHECK(1 == hold_total(stats));
+        CHECK(longest >= 12);
+    }
+
+    void check_concurrent_snapshots()
+    {
+        pool_type pool{ 8, 2 };
+
+        std::atomic<bool> stop{ false };
+
+        std::thread worker{ [&]()
+        {
+            while (!stop.load(std::memory_order_relaxed))
+            {
+                auto a = pool.allocate();
+                auto b = pool.allocate();
+            }
+        } };
+
+        for (auto i = 0; i < 10000; ++i)
+        {
+            const auto stats = pool.stats();
+
+            CHECK(stats.in_use >= 0 && stats.in_use <= stats.capacity);
+            CHECK(stats.high_water <= stats.capacity);
+        }
+
+        stop.store(true, std::memory_order_relaxed);
+
+        worker.join();
+
+        const auto stats = pool.stats();
+
+        CHECK(0 == stats.in_use);
+        CHECK(stats.allocations == stats.releases);
+        CHECK(stats.releases == hold_total(stats));
+    }
+}
+
+int main()
+{
+    check_counts(0);
+    check_counts(2);
+    check_hold_time();
+    check_concurrent_snapshots();
+
+    return check_result();
+}
@@ -0,0 +1,169 @@
+// SizeClassPool's classes, and AudioDemux filling blocks whose length comes
+// from the class they were taken from.
+#include "stdafx.h"
+
+#include "AudioDemux.h"
+#include "SizeClassPool.h"
+#include "check.h"
+
+namespace
+{
+    typedef AudioDemux<float, 32> demux_type;
+    typedef demux_type::block_type block_type;
+    typedef SizeClassPool<block_type, 32> pools_type;
+
+    pools_type::pool_type::Config make_config()
+    {
+        pools_type::pool_type::Config config;
+
+        config.buffer_count = 8;
+
+        return config;
+    }
+
+    void check_classes()
+    {
+        // 1000 and 5000 round up to 1024 and 8192: four classes.
+        pools_type pools{ make_config(), 1000, 5000 };
+
+        CHECK(1024 == pools.class_size(1));
+        CHECK(1024 == pools.class_size(1024));
+        CHECK(2048 == pools.class_size(1025));
+        CHECK(8192 == pools.class_size(8192));
+        CHECK(0 == pools.class_size(8193));
+
+        // Nothing is made until it's asked for.
+        CHECK(0 == pools.class_count());
+
+        const auto small = pools.pool_for(100);
+        const auto large = pools.pool_for(3000);
+
+        CHECK(1024 == small->payload_size());
+        CHECK(4096 == large->payload_size());
+        CHECK(small == pools.pool_for(1024));
+        CHECK(large == pools.pool_for(4096));
+        CHECK(2 == pools.class_count());
+
+        auto threw = false;
+
+        try
+        {
+            pools.pool_for(8193);
+        }
+        catch (const std::invalid_argument&)
+        {
+            threw = true;
+        }
+
+        CHECK(threw);
+        CHECK(2 == pools.class_count());
+    }
+
+    void check_refill_handler()
+    {
+        pools_type::pool_type::Config config;
+
+        config.buffer_count = 2;
+        config.max_count = 4;
+        config.grow_chunk = 2;
+        config.low_watermark = 1;
+        config.high_watermark = 4;
+
+        pools_type pools{ config, 1024, 4096 };
+
+        auto requests = 0;
+
+        const auto before = pools.pool_for(1024);
+
+        pools.set_refill_handler([&requests]() { ++requests; });
+
+        // Made after the handler was set, and still given it.
+        const auto after = pools.pool_for(4096);
+
+        for (const auto& pool : { before, after })
+        {
+            const auto count = requests;
+            auto a = pool->allocate();
+            auto b = pool->allocate();
+
+            CHECK(a && b);
+            CHECK(requests > count);
+
+            pools.maintain();
+
+            CHECK(pool->capacity() > 2);
+        }
+    }
+
+    // Six channels of a 480 frame period need 11520 bytes, so they get the
+    // 16384 byte class and blocks of 680 frames.
+    void check_demux()
+    {
+        const auto channels = 6;
+        const size_t period = 480;
+
+        pools_type pools{ make_config(), block_type::payload_size(1, 256), block_type::payload_size(8, 8192) };
+
+        const auto pool = pools.pool_for(block_type::payload_size(channels, period));
+
+        CHECK(16384 == pool->payload_size());
+
+        const auto demux = demux_type::create(pool, SampleFormat::float32, channels);
+        const auto block_frames = demux->block_frames();
+
+        CHECK(680 == block_frames);
+        CHECK(block_frames >= period);
+        CHECK(block_type::payload_size(channels, block_frames) <= pool->payload_size());
+
+        const size_t frames = 4 * block_frames + 100;
+        std::vector<float> input(frames * channels);
+
+        for (size_t i = 0; i < frames; ++i)
+        {
+            for (auto c = 0; c < channels; ++c)
+                input[i * channels + c] = static_cast<float>(c * 100000 + i);
+        }
+
+        for (size_t start = 0; start < frames; start += period)
+        {
+            const auto count = std::min(period, frames - start);
+
+            demux->add(&input[start * channels], count * channels * sizeof(float));
+        }
+
+        pools_type::pool_type::unique_ptr_type block;
+        size_t next = 0;
+
+        while (demux->queue().try_pop(block))
+        {
+            CHECK(block_frames == block->length);
+            CHECK(block_frames == block->capacity);
+            CHECK(channels == static_cast<int>(block->channels));
+
+            // Each plane ends before the next one starts, and every sample
+            // landed in the right one.
+            for (auto c = 0; c < channels; ++c)
+            {
+                CHECK(block->plane(c) + block_frames <= block->plane(c + 1));
+
+                for (size_t i = 0; i < block->length; ++i)
+                    CHECK(block->plane(c)[i] == static_cast<float>(c * 100000 + next + i));
+            }
+
+            next += block->length;
+
+            block.reset();
+        }
+
+        CHECK(4 * block_frames == next);
+    }
+}
+
+int main()
+{
+    check_classes();
+    check_refill_handler();
+    check_demux();
+
+    return check_result();
+}
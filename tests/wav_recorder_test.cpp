@@ -0,0 +1,183 @@
+// WavRecorder never has more than in_flight writes outstanding, and the file
+// it leaves, read back through WavFile, holds exactly the samples it was
+// given, however the adds fall against the chunk boundaries.
+#include "stdafx.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+#include <unistd.h>
+
+#include "WavFile.h"
+#include "WavRecorder.h"
+#include "check.h"
+
+namespace
+{
+    const int channels = 2;
+
+    // A fresh file in the temporary directory, removed when it goes.
+    class TempFile final
+    {
+    public:
+        TempFile()
+        {
+            const auto dir = getenv("TMPDIR");
+            std::string pattern = std::string(dir && *dir ? dir : "/tmp") + "/wav_recorder_test_XXXXXX";
+
+            const auto fd = mkstemp(&pattern[0]);
+
+            if (fd < 0)
+                throw std::runtime_error("wav_recorder_test: can't create " + pattern);
+
+            ::close(fd);
+
+            path_ = pattern;
+        }
+        TempFile(const TempFile&) = delete;
+        TempFile& operator=(const TempFile&) = delete;
+        ~TempFile() { remove(path_.c_str()); }
+
+        const std::string& path() const noexcept { return path_; }
+    private:
+        std::string path_;
+    };
+
+    // Exactly representable, and different for every sample in the file.
+    float sample(const uint64_t frame, const int channel)
+    {
+        return static_cast<float>((frame * channels + channel) % 65536) / 65536.0f - 0.5f;
+    }
+
+    void check_in_flight(const int in_flight)
+    {
+        const TempFile file;
+        const size_t period = 4096;
+
+        WavRecorder::Config config;
+
+        // A chunk per add(), so the writes pile up behind each other.
+        config.chunk_size = 64 * 1024;
+        config.in_flight = in_flight;
+        config.unbuffered = false;
+
+        uint64_t added = 0;
+        WavRecorder::Stats stats{};
+
+        {
+            WavRecorder recorder{ file.path(), channels, 48000, config };
+
+            std::vector<float> samples(period, 0.25f);
+            const float* planes[channels] = { samples.data(), samples.data() };
+
+            for (auto i = 0; i < 200; ++i, added += period)
+                recorder.add(planes, period);
+
+            recorder.close();
+
+            stats = recorder.stats();
+        }
+
+        CHECK(stats.in_flight_high_water >= 1);
+        CHECK(stats.in_flight_high_water <= std::max(in_flight, 2));
+        CHECK(stats.frames + stats.dropped_frames == added);
+        CHECK(0 == stats.write_errors);
+
+        const WavFile wav{ file.path() };
+
+        CHECK(wav.channels() == channels);
+        CHECK(wav.frames() == stats.frames);
+    }
+
+    // Adds of period frames, a size that doesn't divide the 64 KiB chunks, so
+    // frames straddle every chunk boundary.  Paced so nothing is dropped.
+    void check_samples(const size_t period, const bool unbuffered)
+    {
+        const TempFile file;
+        const uint64_t total = 100000;
+
+        WavRecorder::Config config;
+
+        config.chunk_size = 64 * 1024;
+        config.in_flight = 2;
+        config.unbuffered = unbuffered;
+
+        WavRecorder::Stats stats{};
+
+        {
+            WavRecorder recorder{ file.path(), channels, 44100, config };
+
+            std::vector<float> left(period);
+            std::vector<float> right(period);
+            const float* planes[channels] = { left.data(), right.data() };
+
+            for (uint64_t start = 0; start < total; start += period)
+            {
+                const auto length = static_cast<size_t>(std::min<uint64_t>(period, total - start));
+
+                for (size_t i = 0; i < length; ++i)
+                {
+                    left[i] = sample(start + i, 0);
+                    right[i] = sample(start + i, 1);
+                }
+
+                recorder.add(planes, length);
+
+                std::this_thread::sleep_for(std::chrono::microseconds{ 200 });
+            }
+
+            recorder.close();
+
+            stats = recorder.stats();
+        }
+
+        CHECK(0 == stats.dropped_frames);
+        CHECK(total == stats.frames);
+
+        const WavFile wav{ file.path() };
+
+        CHECK(wav.channels() == channels);
+        CHECK(wav.sample_rate() == 44100);
+        CHECK(SampleFormat::float32 == wav.format());
+        CHECK(total == wav.frames());
+
+        uint64_t mismatched = 0;
+
+        for (uint64_t n = 0; n < std::min<uint64_t>(total, wav.frames()); ++n)
+        {
+            for (auto c = 0; c < channels; ++c)
+            {
+                float value;
+
+                memcpy(&value, wav.data() + (n * channels + c) * sizeof(float), sizeof(value));
+
+                mismatched += value != sample(n, c);
+            }
+        }
+
+        CHECK(0 == mismatched);
+    }
+}
+
+int main()
+{
+    try
+    {
+        for (const auto in_flight : { 1, 2, 4 })
+            check_in_flight(in_flight);
+
+        for (const auto unbuffered : { false, true })
+        {
+            check_samples(1000, unbuffered);
+            check_samples(4093, unbuffered);
+        }
+    }
+    catch (const std::exception& ex)
+    {
+        fprintf(stderr, "%s\n", ex.what());
+
+        return 1;
+    }
+
+    return check_result();
+}